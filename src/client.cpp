@@ -0,0 +1,156 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "protocol.h"
+#include "readimage.h"
+#include "masking.h"
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+using namespace std;
+
+void print_usage(char *program){
+	fprintf(stderr, "Usage: %s [-f] [-n num_requests] socket_path hyperspectral_filename.\n", program);
+	fprintf(stderr, "  -f  Read the image here and pass the data to the server through shared memory, instead of passing the filename\n");
+	fprintf(stderr, "  -n  Send the request several times over the same connection, print the last mask\n");
+}
+
+int connect_to_server(const char *socket_path){
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((server < 0) || (connect(server, (struct sockaddr*)&address, sizeof(address)) < 0)){
+		fprintf(stderr, "Could not connect to masking server at %s\n", socket_path);
+		exit(1);
+	}
+	return server;
+}
+
+/**
+ * Read full image into shared memory. 
+ * \return File descriptor
+ **/
+int read_image_to_shared_memory(char *filename, HyspexHeader *header){
+	size_t size = sizeof(float)*header->lines*header->bands*header->samples;
+	int fd = protocol_create_shared_memory(size);
+	float *data = (fd >= 0) ? (float*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : (float*)MAP_FAILED;
+	if (data == MAP_FAILED){
+		fprintf(stderr, "Could not create shared memory for image data\n");
+		exit(1);
+	}
+	ImageSubset subset;
+	subset.startSamp = 0;
+	subset.endSamp = header->samples;
+	subset.startLine = 0;
+	subset.endLine = header->lines;
+	subset.startBand = 0;
+	subset.endBand = header->bands;
+	hyperspectral_read_image(filename, header, subset, data);
+	munmap(data, size);
+	return fd;
+}
+
+int main(int argc, char *argv[]){
+	bool pass_data = false;
+	int num_requests = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "fn:")) != -1){
+		switch (opt){
+			case 'f':
+				pass_data = true;
+			break;
+			case 'n':
+				num_requests = atoi(optarg);
+			break;
+			default:
+				print_usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (optind + 2 > argc){
+		print_usage(argv[0]);
+		exit(1);
+	}
+	char *socket_path = argv[optind];
+	char *filename = argv[optind+1];
+
+	protocol_request_t request;
+	memset(&request, 0, sizeof(request));
+	request.masking_type = REFLECTANCE_MASKING;
+	int data_fd = -1;
+	HyspexHeader header;
+	if (pass_data){
+		hyperspectral_read_header(filename, &header);
+		data_fd = read_image_to_shared_memory(filename, &header);
+		request.type = PROTOCOL_REQUEST_DATA;
+		request.samples = header.samples;
+		request.lines = header.lines;
+		request.bands = header.bands;
+	} else {
+		//server might run in another working directory
+		request.type = PROTOCOL_REQUEST_FILE;
+		char abspath[PATH_MAX];
+		if (realpath(filename, abspath) == NULL){
+			fprintf(stderr, "Could not find file: %s\n", filename);
+			exit(1);
+		}
+		if (strlen(abspath) >= PROTOCOL_MAX_PATH){
+			fprintf(stderr, "Path too long: %s\n", abspath);
+			exit(1);
+		}
+		strcpy(request.filename, abspath);
+	}
+
+	int server = connect_to_server(socket_path);
+	protocol_response_t response;
+	int mask_fd = -1;
+	for (int i=0; i < num_requests; i++){
+		if (mask_fd >= 0){
+			close(mask_fd);
+		}
+		bool sent = protocol_send(server, &request, sizeof(request), data_fd);
+		if (sent && pass_data){
+			sent = protocol_send(server, &header.wlens[0], sizeof(float)*header.bands, -1);
+		}
+		if (!sent || !protocol_recv(server, &response, sizeof(response), &mask_fd)){
+			fprintf(stderr, "Lost connection to masking server\n");
+			exit(1);
+		}
+		if (response.status != PROTOCOL_OK){
+			fprintf(stderr, "Masking server error: %s\n", response.message);
+			exit(1);
+		}
+	}
+	close(server);
+
+	size_t size = (size_t)response.lines*response.samples;
+	unsigned char *mask = (mask_fd >= 0) ? (unsigned char*)mmap(NULL, size, PROT_READ, MAP_SHARED, mask_fd, 0) : (unsigned char*)MAP_FAILED;
+	if (mask == MAP_FAILED){
+		fprintf(stderr, "No mask returned from masking server\n");
+		exit(1);
+	}
+	for (int i=0; i < response.lines; i++){
+		for (int j=0; j < response.samples; j++){
+			cout << (int)mask[(size_t)i*response.samples + j] << " ";
+		}
+		cout << endl;
+	}
+	munmap(mask, size);
+	close(mask_fd);
+	if (data_fd >= 0){
+		close(data_fd);
+	}
+}
@@ -8,17 +8,172 @@
 #include "readimage.h"
 #include "masking.h"
 #include "spectral.h"
+#include "shard.h"
+#include "postprocess.h"
+#include "server.h"
 #include <iostream>
 #include <sys/time.h>
+#include <unistd.h>
 using namespace std;
 
+#define DEFAULT_ANGLE_MARGIN 0.05
+#define DEFAULT_NUM_WORKERS 4
+
+void print_usage(char *program){
+	fprintf(stderr, "Usage: %s -d socket_path [-w num_workers]\n", program);
+	fprintf(stderr, "       %s [-j num_processes] [-r] [-o radius] [-c radius] [-s region_filename] [-q qa_basename] [-b block_size] [-e angle_margin] [-g batch_lines] [-p num_groups] [-t target_ms] hyperspectral_filename.\n", program);
+	fprintf(stderr, "  -d  Run as masking server on the given Unix domain socket, see masking-client\n");
+	fprintf(stderr, "  -w  Number of worker threads in server (default %d)\n", DEFAULT_NUM_WORKERS);
+	fprintf(stderr, "  -j  Split the image into line shards masked by separate processes, merge their reference spectra. Compressed images must be seekable zstd\n");
+	fprintf(stderr, "  -r  Mask the image once more using the merged reference spectra (with -j)\n");
+	fprintf(stderr, "  -o  Morphological opening of the mask with a square of the given radius\n");
+	fprintf(stderr, "  -c  Morphological closing of the mask with a square of the given radius\n");
+	fprintf(stderr, "  -s  Write area and bounding box of each connected region in the mask to file\n");
+	fprintf(stderr, "  -q  Write raw mask, minimum SAM angle and best-matching reference spectrum as ENVI images qa_basename_{mask,angle,reference}\n");
+	fprintf(stderr, "  -b  Coarse-to-fine masking: classify center pixels of blocks first, full resolution only in mixed blocks\n");
+	fprintf(stderr, "  -e  Refine blocks whose center pixel SAM angle is within this distance of the threshold (with -b, default %g)\n", DEFAULT_ANGLE_MARGIN);
+	fprintf(stderr, "  -p  Pre-filter pixels using sums over this number of band groups, report rejection rate (default no pre-filter)\n");
+	fprintf(stderr, "  -t  Per-line latency target in milliseconds. Adaptive updates are deferred, subsampled and finally skipped while lines are late, reports line latencies\n");
+	fprintf(stderr, "  -g  Mask blocks of lines in batch with reference spectra held fixed within each block, for throughput\n");
+}
+
+/**
+ * ENVI images for per-pixel QA outputs. 
+ **/
+typedef struct{
+	HyspexWriter mask;
+	HyspexWriter angle;
+	HyspexWriter reference;
+} qa_output_t;
+
+void open_qa_image(HyspexWriter *writer, const char *basename, const char *suffix, int samples, int lines, int datatype){
+	string filename = string(basename) + "_" + suffix;
+	hyperspectral_writer_open(writer, filename.c_str(), 1, samples, lines, vector<float>(), datatype);
+}
+
+void open_qa_output(const char *basename, int samples, int lines, qa_output_t *qa){
+	open_qa_image(&(qa->mask), basename, "mask", samples, lines, 1);
+	open_qa_image(&(qa->angle), basename, "angle", samples, lines, 4);
+	open_qa_image(&(qa->reference), basename, "reference", samples, lines, 12);
+}
+
+void write_qa_lines(qa_output_t *qa, int lines, const unsigned char *mask, const float *min_angle, const unsigned short *best_reference){
+	hyperspectral_writer_write_lines(&(qa->mask), lines, mask, 1);
+	hyperspectral_writer_write_lines(&(qa->angle), lines, min_angle, 4);
+	hyperspectral_writer_write_lines(&(qa->reference), lines, best_reference, 12);
+}
+
+void close_qa_output(qa_output_t *qa){
+	hyperspectral_writer_close(&(qa->mask));
+	hyperspectral_writer_close(&(qa->angle));
+	hyperspectral_writer_close(&(qa->reference));
+}
+
+void print_mask_line(int num_samples, const unsigned char *mask){
+	for (int j=0; j < num_samples; j++){
+		cout << (int)mask[j] << " ";
+	}
+	cout << endl;
+}
+
+/**
+ * Output raw mask line, through the post-processing pipeline if enabled. 
+ **/
+void output_mask_line(mask_postprocess_t *postprocess, int num_samples, unsigned char *mask){
+	if (postprocess == NULL){
+		print_mask_line(num_samples, mask);
+		return;
+	}
+	mask_postprocess_push_line(postprocess, mask);
+	while (mask_postprocess_pop_line(postprocess, mask)){
+		print_mask_line(num_samples, mask);
+	}
+}
+
+void write_regions(mask_postprocess_t *postprocess, FILE *fp){
+	mask_region_t region;
+	while (mask_postprocess_pop_region(postprocess, &region)){
+		fprintf(fp, "%ld %ld %d %ld %d\n", region.area, region.start_line, region.start_sample, region.end_line, region.end_sample);
+	}
+}
+
 int main(int argc, char *argv[]){
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s hyperspectral_filename.\n", argv[0]);
+	int num_shards = 0;
+	bool second_pass = false;
+	int opening_radius = 0;
+	int closing_radius = 0;
+	char *region_filename = NULL;
+	char *qa_basename = NULL;
+	masking_coarse_t coarse;
+	coarse.block_size = 0;
+	coarse.angle_margin = DEFAULT_ANGLE_MARGIN;
+	int batch_lines = 0;
+	int prefilter_groups = -1;
+	double latency_target = 0;
+	char *socket_path = NULL;
+	int num_workers = DEFAULT_NUM_WORKERS;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:ro:c:s:q:b:e:g:p:t:d:w:")) != -1){
+		switch (opt){
+			case 'j':
+				num_shards = atoi(optarg);
+			break;
+			case 'r':
+				second_pass = true;
+			break;
+			case 'o':
+				opening_radius = atoi(optarg);
+			break;
+			case 'c':
+				closing_radius = atoi(optarg);
+			break;
+			case 's':
+				region_filename = optarg;
+			break;
+			case 'q':
+				qa_basename = optarg;
+			break;
+			case 'b':
+				coarse.block_size = atoi(optarg);
+			break;
+			case 'e':
+				coarse.angle_margin = atof(optarg);
+			break;
+			case 'g':
+				batch_lines = atoi(optarg);
+			break;
+			case 'p':
+				prefilter_groups = atoi(optarg);
+			break;
+			case 't':
+				latency_target = atof(optarg)*1.0e-3;
+			break;
+			case 'd':
+				socket_path = optarg;
+			break;
+			case 'w':
+				num_workers = atoi(optarg);
+			break;
+			default:
+				print_usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	if (socket_path != NULL){
+		return (masking_server_run(socket_path, (num_workers > 0) ? num_workers : 1) == 0) ? 0 : 1;
+	}
+
+	if (optind >= argc) {
+		print_usage(argv[0]);
 		exit(1);
 	}
 
-	char* filename = argv[1];
+	char* filename = argv[optind];
+	if ((latency_target > 0) && ((num_shards > 0) || (coarse.block_size > 0) || (batch_lines > 0))){
+		fprintf(stderr, "Latency target (-t) applies to line by line masking only, not with -j, -b or -g\n");
+		exit(1);
+	}
 
 	//read hyperspectral image header
 	HyspexHeader header;
@@ -36,33 +191,132 @@ int main(int argc, char *argv[]){
 		fprintf(stderr, "Error in initializing masking parameters: %s\n", masking_error_message(errcode));
 		exit(1);
 	}
+	if (prefilter_groups >= 0){
+		masking_set_prefilter(&mask_param, prefilter_groups);
+	}
+
+	//post-processing of the mask
+	mask_postprocess_t postprocess;
+	bool use_postprocess = (opening_radius > 0) || (closing_radius > 0) || (region_filename != NULL);
+	FILE *region_file = NULL;
+	if (use_postprocess){
+		mask_postprocess_init(&postprocess, header.samples, opening_radius, closing_radius);
+	}
+	if (region_filename != NULL){
+		region_file = fopen(region_filename, "wt");
+		if (region_file == NULL){
+			fprintf(stderr, "Could not open region file: %s\n", region_filename);
+			exit(1);
+		}
+		fprintf(region_file, "area start_line start_sample end_line end_sample\n");
+	}
+
+	//per-pixel QA images
+	qa_output_t qa;
+	if (qa_basename != NULL){
+		open_qa_output(qa_basename, header.samples, header.lines, &qa);
+	}
+
+	const masking_coarse_t *use_coarse = (coarse.block_size > 0) ? &coarse : NULL;
+	masking_budget_t budget;
+	masking_budget_init(&budget, latency_target);
+	masking_budget_t *use_budget = (latency_target > 0) ? &budget : NULL;
+	long num_classified = 0;
+	if (num_shards > 0){
+		//mask image using several processes, output each shard as it completes
+		shard_run_t run;
+		mask_image_sharded_start(filename, &header, &mask_param, num_shards, second_pass, qa_basename != NULL, use_coarse, batch_lines, &run);
+		unsigned char *mask;
+		float *min_angle;
+		unsigned short *best_reference;
+		int num_lines;
+		while ((num_lines = mask_image_sharded_next(&run, &mask, &min_angle, &best_reference)) > 0){
+			if (qa_basename != NULL){
+				write_qa_lines(&qa, num_lines, mask, min_angle, best_reference);
+			}
+			for (int l=0; l < num_lines; l++){
+				output_mask_line(use_postprocess ? &postprocess : NULL, header.samples, mask + (size_t)l*header.samples);
+				if (region_file != NULL){
+					write_regions(&postprocess, region_file);
+				}
+			}
+		}
+		num_classified = mask_image_sharded_finish(&run);
+	} else {
+		//read image and mask line by line, or block row by block row
+		int num_block_lines = 1;
+		if (use_coarse != NULL){
+			num_block_lines = coarse.block_size;
+		} else if (batch_lines > 0){
+			num_block_lines = batch_lines;
+		}
+		size_t num_block_pixels = (size_t)num_block_lines*header.samples;
+		unsigned char *mask = new unsigned char[num_block_pixels];
+		float *min_angle = (qa_basename != NULL) ? new float[num_block_pixels] : NULL;
+		unsigned short *best_reference = (qa_basename != NULL) ? new unsigned short[num_block_pixels] : NULL;
+		HyspexReader reader;
+		hyperspectral_reader_open(&reader, filename, &header);
+		masking_coarse_state_t coarse_state;
+		if (use_coarse != NULL){
+			masking_coarse_state_init(&mask_param, header.samples, use_coarse, &coarse_state);
+		}
+		for (int i=0; i < header.lines; i += num_block_lines){
+			int num_lines = min(num_block_lines, header.lines - i);
+			long num_block_classified = mask_image_lines(&reader, &mask_param, num_lines, mask, min_angle, best_reference, use_coarse, batch_lines, use_budget, (use_coarse != NULL) ? &coarse_state : NULL);
+			if (num_block_classified < 0){
+				exit(1);
+			}
+			num_classified += num_block_classified;
+			if (qa_basename != NULL){
+				write_qa_lines(&qa, num_lines, mask, min_angle, best_reference);
+			}
+			for (int l=0; l < num_lines; l++){
+				output_mask_line(use_postprocess ? &postprocess : NULL, header.samples, mask + (size_t)l*header.samples);
+				if (region_file != NULL){
+					write_regions(&postprocess, region_file);
+				}
+			}
+		}
+		hyperspectral_reader_close(&reader);
+		if (use_coarse != NULL){
+			masking_coarse_state_free(&coarse_state);
+		}
+		delete [] mask;
+		delete [] min_angle;
+		delete [] best_reference;
+	}
+
+	if (qa_basename != NULL){
+		close_qa_output(&qa);
+	}
+	if (use_coarse != NULL){
+		fprintf(stderr, "Classified %ld of %ld pixels at full resolution\n", num_classified, (long)header.lines*header.samples);
+	}
+	if (prefilter_groups >= 0){
+		masking_prefilter_stats_t stats;
+		masking_get_prefilter_stats(&mask_param, &stats);
+		fprintf(stderr, "Pre-filter rejected %ld of %ld tested pixels\n", stats.num_rejected, stats.num_tested);
+	}
+	if (use_budget != NULL){
+		masking_budget_stats_t stats;
+		masking_get_budget_stats(use_budget, &stats);
+		fprintf(stderr, "Line latency p50 %.3f ms, p99 %.3f ms, max %.3f ms over %ld lines\n", stats.p50*1.0e3, stats.p99*1.0e3, stats.max*1.0e3, stats.num_lines);
+		fprintf(stderr, "Lines per level: full %ld, deferred updates %ld, subsampled updates %ld, classify only %ld\n", stats.level_count[MASKING_BUDGET_FULL], stats.level_count[MASKING_BUDGET_DEFERRED_UPDATES], stats.level_count[MASKING_BUDGET_SUBSAMPLED_UPDATES], stats.level_count[MASKING_BUDGET_CLASSIFY_ONLY]);
+	}
 
-	mask_thresh_t thresh_val = masking_allocate_thresh(&mask_param, header.samples);
-
-	//read image and mask
-	for (int i=0; i < header.lines; i++){
-		ImageSubset subset;
-		subset.startSamp = 0;
-		subset.endSamp = header.samples;
-		subset.startLine = i;
-		subset.endLine = i+1;
-		subset.startBand = 0;
-		subset.endBand = header.bands;
-	
-		//read line
-		float *line = new float[header.samples*(end_band - start_band)];
-		hyperspectral_read_image(filename, &header, subset, line);
-		
-		//mask line
-		masking_thresh(&mask_param, header.samples, line, &thresh_val);
-		for (int i=0; i < header.samples; i++){
-			cout << masking_pixel_belongs(&mask_param, thresh_val, i) << " ";
+	if (use_postprocess){
+		unsigned char *mask = new unsigned char[header.samples];
+		mask_postprocess_finish(&postprocess);
+		while (mask_postprocess_pop_line(&postprocess, mask)){
+			print_mask_line(header.samples, mask);
+		}
+		if (region_file != NULL){
+			write_regions(&postprocess, region_file);
+			fclose(region_file);
 		}
-		
-		cout << endl;
-		delete [] line;
+		delete [] mask;
+		mask_postprocess_free(&postprocess);
 	}
-	masking_free_thresh(&thresh_val, header.samples);
 	masking_free(&mask_param);
 	delete [] wlens;
 }	
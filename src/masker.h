@@ -0,0 +1,229 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef MASKER_H_DEFINED
+#define MASKER_H_DEFINED
+
+#include "masking.h"
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace masking {
+
+/**
+ * Non-owning view over a contiguous range of caller-owned values. 
+ **/
+template<typename T>
+struct span{
+	T *data;
+	size_t size;
+
+	span() : data(NULL), size(0){}
+	span(T *data, size_t size) : data(data), size(size){}
+	span(std::vector<T> &vec) : data(vec.data()), size(vec.size()){}
+	T &operator[](size_t i) const { return data[i]; }
+};
+
+/**
+ * Non-owning view over caller-owned hyperspectral data with explicit strides, in number of floats. 
+ * Band b of sample j in line i is found at data[i*line_stride + j*sample_stride + b*band_stride]. 
+ **/
+struct image_view{
+	const float *data;
+	int samples;
+	int bands;
+	int lines;
+	long sample_stride;
+	long band_stride;
+	long line_stride;
+
+	/**
+	 * Band interleaved by line, as read by hyperspectral_read_image(). 
+	 **/
+	static image_view bil(const float *data, int samples, int bands, int lines){
+		image_view view = {data, samples, bands, lines, 1, samples, (long)samples*bands};
+		return view;
+	}
+
+	/**
+	 * Band interleaved by pixel. 
+	 **/
+	static image_view bip(const float *data, int samples, int bands, int lines){
+		image_view view = {data, samples, bands, lines, bands, 1, (long)samples*bands};
+		return view;
+	}
+
+	/**
+	 * Band sequential. 
+	 **/
+	static image_view bsq(const float *data, int samples, int bands, int lines){
+		image_view view = {data, samples, bands, lines, 1, (long)samples*lines, samples};
+		return view;
+	}
+
+	/**
+	 * Sub-window of the view. Shares data with the view. 
+	 **/
+	image_view window(int start_line, int num_lines, int start_sample, int num_samples, int start_band, int num_bands) const {
+		if ((start_line < 0) || (start_line + num_lines > lines) || (start_sample < 0) || (start_sample + num_samples > samples) || (start_band < 0) || (start_band + num_bands > bands)){
+			throw std::out_of_range("Window outside of image view");
+		}
+		image_view view = {data + start_line*line_stride + start_sample*sample_stride + start_band*band_stride, num_samples, num_bands, num_lines, sample_stride, band_stride, line_stride};
+		return view;
+	}
+
+	/**
+	 * Start of specified line. 
+	 **/
+	const float *line(int i) const { return data + i*line_stride; }
+};
+
+/**
+ * Owns masking parameters and thresholding buffers. Move-only, moves do not throw, so that Maskers can be kept in containers. Masks image views in any layout directly into caller-provided output. 
+ * Reference spectra are updated as lines are masked, in the same way as masking_thresh(). 
+ **/
+class Masker{
+	public:
+		/**
+		 * Initialize masking parameters, see masking_init(). Throws std::runtime_error on failure. 
+		 * \param wlens Wavelengths of the bands in the images to be masked
+		 * \param masking_type Whether transmittance or reflectance masking
+		 **/
+		Masker(const std::vector<float> &wlens, masking_input_data_type_t masking_type = REFLECTANCE_MASKING) : thresh_(NULL), thresh_samples_(0), valid_(false){
+			std::vector<float> wlens_copy(wlens);
+			masking_err_t errcode = masking_init(wlens_copy.size(), wlens_copy.data(), masking_type, &param_);
+			if (errcode != MASKING_NO_ERR){
+				throw std::runtime_error(masking_error_message(errcode));
+			}
+			valid_ = true;
+		}
+
+		Masker(Masker &&other) noexcept : param_(other.param_), thresh_(other.thresh_), thresh_samples_(other.thresh_samples_), valid_(other.valid_){
+			other.release();
+		}
+
+		Masker &operator=(Masker &&other) noexcept {
+			if (this != &other){
+				free();
+				param_ = other.param_;
+				thresh_ = other.thresh_;
+				thresh_samples_ = other.thresh_samples_;
+				valid_ = other.valid_;
+				other.release();
+			}
+			return *this;
+		}
+
+		Masker(const Masker &) = delete;
+		Masker &operator=(const Masker &) = delete;
+
+		~Masker(){
+			free();
+		}
+
+		/**
+		 * Mask one line of the view. 
+		 * \param view Hyperspectral data, must have num_bands() bands
+		 * \param line Line index within view
+		 * \param mask Output, view.samples values, 1 if pixel belongs to the segmented image
+		 **/
+		void mask_line(const image_view &view, int line, span<unsigned char> mask){
+			check_view(view);
+			if ((line < 0) || (line >= view.lines)){
+				throw std::out_of_range("Line outside of image view");
+			}
+			if (mask.size < (size_t)view.samples){
+				throw std::length_error("Mask output too small for line");
+			}
+			reserve(view.samples);
+			masking_thresh_strided(&param_, view.samples, view.line(line), view.sample_stride, view.band_stride, &thresh_);
+			for (int j=0; j < view.samples; j++){
+				mask[j] = masking_pixel_belongs(&param_, thresh_, j);
+			}
+		}
+
+		/**
+		 * Mask all lines of the view. 
+		 * \param view Hyperspectral data, must have num_bands() bands
+		 * \param mask Output, line i starts at mask[i*mask_line_stride]
+		 * \param mask_line_stride Distance between output lines, at least view.samples. Defaults to view.samples
+		 **/
+		void mask(const image_view &view, span<unsigned char> mask, size_t mask_line_stride = 0){
+			if (mask_line_stride == 0){
+				mask_line_stride = view.samples;
+			}
+			if (mask_line_stride < (size_t)view.samples){
+				throw std::invalid_argument("Mask line stride smaller than number of samples in image view");
+			}
+			if ((view.lines > 0) && (mask.size < (view.lines - 1)*mask_line_stride + view.samples)){
+				throw std::length_error("Mask output too small for image view");
+			}
+			for (int i=0; i < view.lines; i++){
+				mask_line(view, i, span<unsigned char>(mask.data + i*mask_line_stride, view.samples));
+			}
+		}
+
+		/**
+		 * Number of bands expected in image views. 
+		 **/
+		int num_bands() const { return param_.num_bands; }
+
+		/**
+		 * Underlying masking parameters. 
+		 **/
+		const masking_t *params() const { return &param_; }
+		masking_t *params() { return &param_; }
+
+	private:
+		masking_t param_;
+		mask_thresh_t thresh_;
+		int thresh_samples_;
+		bool valid_;
+
+		void check_view(const image_view &view) const {
+			if (!valid_){
+				throw std::logic_error("Masker has been moved from");
+			}
+			if (view.bands != param_.num_bands){
+				throw std::invalid_argument("Number of bands in image view does not match masking parameters");
+			}
+		}
+
+		/**
+		 * Make sure thresholding buffer has room for the specified number of samples. 
+		 **/
+		void reserve(int num_samples){
+			if (num_samples > thresh_samples_){
+				if (thresh_ != NULL){
+					masking_free_thresh(&thresh_, thresh_samples_);
+				}
+				thresh_ = masking_allocate_thresh(&param_, num_samples);
+				thresh_samples_ = num_samples;
+			}
+		}
+
+		void free(){
+			if (thresh_ != NULL){
+				masking_free_thresh(&thresh_, thresh_samples_);
+			}
+			if (valid_){
+				masking_free(&param_);
+			}
+			release();
+		}
+
+		void release(){
+			thresh_ = NULL;
+			thresh_samples_ = 0;
+			valid_ = false;
+		}
+};
+
+}
+
+#endif
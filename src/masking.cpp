@@ -7,8 +7,13 @@
 
 #include "masking.h"
 #include "spectral.h"
+#include "masking_index.h"
+#include "masking_prefilter.h"
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
 using namespace std;
 
 #define SAM_THRESH_DEFAULT 0.3
@@ -57,9 +62,50 @@ masking_err_t masking_init(int num_wlens, float *wlens, masking_input_data_type_
 	}
 
 	spectral_free_library(&library);
+	mask_param->index = masking_index_build(mask_param);
+	mask_param->prefilter = NULL;
 	return MASKING_NO_ERR;
 }
 
+void masking_set_prefilter(masking_t *mask_param, int num_groups){
+	masking_prefilter_free(mask_param->prefilter);
+	mask_param->prefilter = masking_prefilter_build(mask_param, num_groups);
+}
+
+void masking_get_prefilter_stats(const masking_t *mask_param, masking_prefilter_stats_t *stats){
+	stats->num_tested = 0;
+	stats->num_rejected = 0;
+	if (mask_param->prefilter != NULL){
+		stats->num_tested = mask_param->prefilter->num_tested;
+		stats->num_rejected = mask_param->prefilter->num_rejected;
+	}
+}
+
+void masking_add_prefilter_stats(masking_t *mask_param, const masking_prefilter_stats_t *stats){
+	if (mask_param->prefilter != NULL){
+		mask_param->prefilter->num_tested += stats->num_tested;
+		mask_param->prefilter->num_rejected += stats->num_rejected;
+	}
+}
+
+void masking_copy(masking_t *destination, const masking_t *source){
+	*destination = *source;
+	destination->orig_spectra = new float*[source->num_masking_spectra];
+	destination->updated_spectra = new float*[source->num_masking_spectra];
+	destination->sam_thresh = new float[source->num_masking_spectra];
+	destination->num_samples_in_spectra = new long[source->num_masking_spectra];
+	for (int i=0; i < source->num_masking_spectra; i++){
+		destination->orig_spectra[i] = new float[source->num_bands];
+		destination->updated_spectra[i] = new float[source->num_bands];
+		memcpy(destination->orig_spectra[i], source->orig_spectra[i], sizeof(float)*source->num_bands);
+		memcpy(destination->updated_spectra[i], source->updated_spectra[i], sizeof(float)*source->num_bands);
+		destination->sam_thresh[i] = source->sam_thresh[i];
+		destination->num_samples_in_spectra[i] = source->num_samples_in_spectra[i];
+	}
+	destination->index = masking_index_copy(source->index);
+	destination->prefilter = masking_prefilter_copy(source->prefilter);
+}
+
 void masking_free(masking_t *mask_param){
 	for (int i=0; i < mask_param->num_masking_spectra; i++){
 		delete [] mask_param->orig_spectra[i];
@@ -69,9 +115,59 @@ void masking_free(masking_t *mask_param){
 	delete [] mask_param->updated_spectra;
 	delete [] mask_param->sam_thresh;
 	delete [] mask_param->num_samples_in_spectra;
+	masking_index_free(mask_param->index);
+	masking_prefilter_free(mask_param->prefilter);
 }
 
 void masking_thresh(masking_t *mask_param, int num_samples, float *line_data, mask_thresh_t *ret_thresh){
+	//BIL: bands are num_samples apart
+	masking_thresh_strided(mask_param, num_samples, line_data, 1, num_samples, ret_thresh);
+}
+
+void masking_thresh_strided(masking_t *mask_param, int num_samples, const float *line_data, long sample_stride, long band_stride, mask_thresh_t *ret_thresh){
+	masking_thresh_output(mask_param, num_samples, line_data, sample_stride, band_stride, ret_thresh, NULL);
+}
+
+/**
+ * How updated spectra are updated with the pixels that belong to them. 
+ **/
+enum masking_update_mode_t{
+	/// Update after each pixel
+	MASKING_UPDATE_IMMEDIATE,
+	/// Sum pixels, update at end of line using masking_apply_deferred_updates()
+	MASKING_UPDATE_DEFERRED,
+	/// No updates
+	MASKING_UPDATE_NONE
+};
+
+/**
+ * Scratch data used while masking a line. 
+ **/
+typedef struct{
+	/// Norms of original reference spectra
+	float *ref_norms_orig;
+	/// Norms of updated reference spectra, kept in sync with updated_spectra
+	float *ref_norms_updated;
+	/// Band values of current pixel
+	float *pixel_vals;
+	/// Stack of index nodes to visit
+	int *index_stack;
+	/// Pre-filter data, NULL if the pre-filter is disabled
+	masking_prefilter_state_t *prefilter;
+	/// Whether pixels are compared against the updated spectra
+	bool use_updated;
+	/// How updated spectra are updated
+	masking_update_mode_t update_mode;
+	/// Deferred updates: only every update_stride-th pixel belonging to a reference spectrum is used
+	int update_stride;
+	/// Deferred updates: number of pixels belonging to each reference spectrum in this line
+	long *num_matches;
+	/// Deferred updates: number of pixels and band value sums of the pixels used for updating each reference spectrum, num_bands sums for each
+	long *deferred_counts;
+	double *deferred_sums;
+} masking_line_state_t;
+
+void masking_line_state_init(const masking_t *mask_param, masking_line_state_t *state){
 	//calculate norms of reference spectra
 	float *ref_norms_orig = new float[mask_param->num_masking_spectra]();
 	float *ref_norms_updated = new float[mask_param->num_masking_spectra]();
@@ -83,56 +179,779 @@ void masking_thresh(masking_t *mask_param, int num_samples, float *line_data, ma
 		ref_norms_orig[i] = sqrt(ref_norms_orig[i]);
 		ref_norms_updated[i] = sqrt(ref_norms_updated[i]);
 	}
-	
-	for (int j=0; j < num_samples; j++){
-		//get pixel band values, calculate norm of pixel spectrum
-		float pixel_norm = 0;
-		float *pixel_vals = new float[mask_param->num_bands];
+	state->ref_norms_orig = ref_norms_orig;
+	state->ref_norms_updated = ref_norms_updated;
+	state->pixel_vals = new float[mask_param->num_bands];
+
+	state->index_stack = NULL;
+	if (masking_index_usable(mask_param)){
+		state->index_stack = new int[mask_param->index->centers.size()];
+	}
+
+	state->prefilter = NULL;
+	if (mask_param->prefilter != NULL){
+		state->prefilter = new masking_prefilter_state_t;
+		masking_prefilter_state_init(mask_param, state->prefilter);
+	}
+
+	state->use_updated = true;
+	state->update_mode = MASKING_UPDATE_IMMEDIATE;
+	state->update_stride = 1;
+	state->num_matches = NULL;
+	state->deferred_counts = NULL;
+	state->deferred_sums = NULL;
+}
+
+/**
+ * Collect updates of the updated spectra until the end of the line instead of updating after each pixel. 
+ * \param mask_param Masking parameters
+ * \param state Line scratch data
+ * \param update_stride Use only every update_stride-th pixel belonging to each reference spectrum
+ **/
+void masking_line_state_defer_updates(const masking_t *mask_param, masking_line_state_t *state, int update_stride){
+	state->update_mode = MASKING_UPDATE_DEFERRED;
+	state->update_stride = update_stride;
+	state->num_matches = new long[mask_param->num_masking_spectra]();
+	state->deferred_counts = new long[mask_param->num_masking_spectra]();
+	state->deferred_sums = new double[(long)mask_param->num_masking_spectra*mask_param->num_bands]();
+}
+
+void masking_line_state_free(masking_line_state_t *state){
+	delete [] state->pixel_vals;
+	delete [] state->index_stack;
+	delete state->prefilter;
+	delete [] state->ref_norms_orig;
+	delete [] state->ref_norms_updated;
+	delete [] state->num_matches;
+	delete [] state->deferred_counts;
+	delete [] state->deferred_sums;
+}
+
+/**
+ * Pixel results accumulated over the reference spectra. 
+ **/
+typedef struct{
+	bool belongs;
+	float min_angle;
+	unsigned short best_reference;
+	float thresh_distance;
+} masking_pixel_result_t;
+
+/**
+ * Finish an update of an updated reference spectrum: store its norm and number of samples, keep index and pre-filter valid. 
+ * \param mask_param Masking parameters
+ * \param state Line scratch data
+ * \param k Reference spectrum index
+ * \param prev_norm Norm of the spectrum before the update
+ * \param prev_dot Dot product between the spectrum before and after the update
+ * \param n Number of samples in the spectrum after the update
+ **/
+void masking_finish_update(masking_t *mask_param, masking_line_state_t *state, int k, float prev_norm, double prev_dot, long n){
+	float *ref_norms_updated = state->ref_norms_updated;
+	ref_norms_updated[k] = sqrt(ref_norms_updated[k]);
+	mask_param->num_samples_in_spectra[k] = n;
+
+	//keep index bounds valid for the drifted spectrum
+	if (state->index_stack != NULL){
+		double cos_drift = prev_dot/((double)prev_norm*ref_norms_updated[k]);
+		masking_index_update_reference(mask_param, k, acos(max(-1.0, min(1.0, cos_drift))));
+	}
+	if (state->prefilter != NULL){
+		masking_prefilter_update_reference(mask_param, state->prefilter, k);
+	}
+}
+
+/**
+ * Add the pixel in the line scratch data to the running mean of an updated reference spectrum. 
+ * \param mask_param Masking parameters
+ * \param state Line scratch data, containing the pixel band values
+ * \param k Reference spectrum index
+ **/
+void masking_update_reference(masking_t *mask_param, masking_line_state_t *state, int k){
+	float *ref_norms_updated = state->ref_norms_updated;
+	float *pixel_vals = state->pixel_vals;
+
+	long n = mask_param->num_samples_in_spectra[k];
+	n++;
+	float prev_norm = ref_norms_updated[k];
+	double prev_dot = 0;
+	ref_norms_updated[k] = 0;
+	for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+		double delta = pixel_vals[i] - mask_param->updated_spectra[k][i];
+		float prev_val = mask_param->updated_spectra[k][i];
+
+		//update reference spectrum
+		mask_param->updated_spectra[k][i] += delta/(n*1.0);
+
+		//update norm of reference spectrum
+		ref_norms_updated[k] += mask_param->updated_spectra[k][i]*mask_param->updated_spectra[k][i];
+		prev_dot += (double)prev_val*mask_param->updated_spectra[k][i];
+	}
+	masking_finish_update(mask_param, state, k, prev_norm, prev_dot, n);
+}
+
+/**
+ * Add the pixel in the line scratch data to the deferred update of an updated reference spectrum. 
+ **/
+void masking_defer_update(const masking_t *mask_param, masking_line_state_t *state, int k){
+	double *sums = state->deferred_sums + (long)k*mask_param->num_bands;
+	for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+		sums[i] += state->pixel_vals[i];
+	}
+	state->deferred_counts[k]++;
+}
+
+/**
+ * Add all deferred pixels to the running means of the updated reference spectra at once. 
+ **/
+void masking_apply_deferred_updates(masking_t *mask_param, masking_line_state_t *state){
+	float *ref_norms_updated = state->ref_norms_updated;
+	for (int k=0; k < mask_param->num_masking_spectra; k++){
+		long count = state->deferred_counts[k];
+		if (count == 0){
+			continue;
+		}
+		const double *sums = state->deferred_sums + (long)k*mask_param->num_bands;
+		long n = mask_param->num_samples_in_spectra[k] + count;
+		float prev_norm = ref_norms_updated[k];
+		double prev_dot = 0;
+		ref_norms_updated[k] = 0;
+		for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+			float prev_val = mask_param->updated_spectra[k][i];
+
+			//running mean over count new samples
+			mask_param->updated_spectra[k][i] += (sums[i] - count*(double)prev_val)/(n*1.0);
+
+			ref_norms_updated[k] += mask_param->updated_spectra[k][i]*mask_param->updated_spectra[k][i];
+			prev_dot += (double)prev_val*mask_param->updated_spectra[k][i];
+		}
+		masking_finish_update(mask_param, state, k, prev_norm, prev_dot, n);
+		state->deferred_counts[k] = 0;
+		memset(state->deferred_sums + (long)k*mask_param->num_bands, 0, sizeof(double)*mask_param->num_bands);
+	}
+}
+
+/**
+ * Threshold SAM values of the pixel in the line scratch data against one reference spectrum, update the reference spectrum if the pixel belongs to it. 
+ * \param mask_param Masking parameters
+ * \param state Line scratch data, containing the pixel band values
+ * \param pixel_norm Norm of pixel spectrum
+ * \param k Reference spectrum index
+ * \param ret_thresh Output thresholded values for each reference spectrum
+ * \param result Accumulated pixel results
+ **/
+void masking_thresh_reference(masking_t *mask_param, masking_line_state_t *state, float pixel_norm, int k, bool *ret_thresh, masking_pixel_result_t *result){
+	float *ref_norms_orig = state->ref_norms_orig;
+	float *ref_norms_updated = state->ref_norms_updated;
+	float *pixel_vals = state->pixel_vals;
+
+	float samval_orig = 0;
+	float samval_updated = 0;
+	if (state->use_updated){
 		for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
-			pixel_vals[i] = line_data[i*num_samples + j];
-			pixel_norm += pixel_vals[i]*pixel_vals[i];
+			samval_orig += pixel_vals[i]*mask_param->orig_spectra[k][i];
+			samval_updated += pixel_vals[i]*mask_param->updated_spectra[k][i];
 		}
-		pixel_norm = sqrt(pixel_norm);
+		samval_updated /= pixel_norm*ref_norms_updated[k];
+		samval_updated = acos(samval_updated);
+	} else {
+		//NaN never passes the threshold or becomes the minimum angle
+		for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+			samval_orig += pixel_vals[i]*mask_param->orig_spectra[k][i];
+		}
+		samval_updated = NAN;
+	}
+	samval_orig /= pixel_norm*ref_norms_orig[k];
+	samval_orig = acos(samval_orig);
+
+	//compare against thresholds, save to return array in separate slots
+	bool pixel_belong = (samval_orig < mask_param->sam_thresh[k]) || (samval_updated < mask_param->sam_thresh[k]);
+	ret_thresh[k] = pixel_belong;
+	result->belongs = result->belongs || pixel_belong;
+
+	//keep track of best match, NaN angles are never smaller
+	float angle = fmin(samval_orig, samval_updated);
+	if (angle < result->min_angle){
+		result->min_angle = angle;
+		result->best_reference = k;
+	}
+	result->thresh_distance = fmin(result->thresh_distance, fmin(fabs(samval_orig - mask_param->sam_thresh[k]), fabs(samval_updated - mask_param->sam_thresh[k])));
+
+	//update the updated spectra with new information if above threshold
+	if (pixel_belong){
+		if (state->update_mode == MASKING_UPDATE_IMMEDIATE){
+			masking_update_reference(mask_param, state, k);
+		} else if ((state->update_mode == MASKING_UPDATE_DEFERRED) && (state->num_matches[k]++ % state->update_stride == 0)){
+			masking_defer_update(mask_param, state, k);
+		}
+	}
+}
 
+/**
+ * Threshold SAM values of a single pixel against all reference spectra, update the reference spectra it belongs to. 
+ * \param mask_param Masking parameters
+ * \param state Line scratch data
+ * \param pixel_data First band of pixel
+ * \param band_stride Distance in number of floats between consecutive bands 
+ * \param prune_margin Reference spectra whose SAM angles are provably larger than their thresholds plus this margin are skipped using the index. Non-negative also enables the pre-filter when ret_thresh_distance is NULL. Negative to calculate all SAM angles
+ * \param ret_thresh Output thresholded values for each reference spectrum
+ * \param ret_min_angle Output minimum SAM angle, INFINITY if no angle could be calculated
+ * \param ret_best_reference Output index of reference spectrum with minimum SAM angle
+ * \param ret_thresh_distance Output smallest distance between any SAM angle and its threshold. Can be NULL
+ * \return true if pixel belongs to the segmented image
+ **/
+bool masking_thresh_pixel(masking_t *mask_param, masking_line_state_t *state, const float *pixel_data, long band_stride, float prune_margin, bool *ret_thresh, float *ret_min_angle, unsigned short *ret_best_reference, float *ret_thresh_distance){
+	float *pixel_vals = state->pixel_vals;
+
+	//get pixel band values, calculate norm of pixel spectrum
+	float pixel_norm = 0;
+	for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+		pixel_vals[i] = pixel_data[i*band_stride];
+		pixel_norm += pixel_vals[i]*pixel_vals[i];
+	}
+	pixel_norm = sqrt(pixel_norm);
+
+	masking_pixel_result_t result;
+	result.belongs = false;
+	result.min_angle = INFINITY;
+	result.best_reference = 0;
+	result.thresh_distance = INFINITY;
+
+	if ((prune_margin >= 0) && (ret_thresh_distance == NULL) && (state->prefilter != NULL) && masking_prefilter_reject(mask_param, state->prefilter, pixel_vals, pixel_norm)){
+		//no SAM angle can be within threshold
+		for (int k=0; k < mask_param->num_masking_spectra; k++){
+			ret_thresh[k] = false;
+		}
+	} else if ((prune_margin < 0) || (state->index_stack == NULL)){
 		//calculate sam values against all available spectra
 		for (int k=0; k < mask_param->num_masking_spectra; k++){
-			float samval_orig = 0;
-			float samval_updated = 0;
+			masking_thresh_reference(mask_param, state, pixel_norm, k, ret_thresh, &result);
+		}
+	} else {
+		//calculate sam values only against spectra in index nodes that can be within threshold
+		const masking_index_t *index = mask_param->index;
+		for (int k=0; k < mask_param->num_masking_spectra; k++){
+			ret_thresh[k] = false;
+		}
+		int stack_size = 0;
+		state->index_stack[stack_size++] = 0;
+		while (stack_size > 0){
+			int node = state->index_stack[--stack_size];
+			float lower_bound = masking_index_angle(index, node, pixel_vals, pixel_norm) - index->radius[node];
+			if (lower_bound >= index->max_thresh[node] + prune_margin + MASKING_INDEX_SLACK){
+				continue;
+			}
+			if (index->left[node] < 0){
+				for (int r=index->ref_start[node]; r < index->ref_end[node]; r++){
+					masking_thresh_reference(mask_param, state, pixel_norm, index->refs[r], ret_thresh, &result);
+				}
+			} else {
+				state->index_stack[stack_size++] = index->right[node];
+				state->index_stack[stack_size++] = index->left[node];
+			}
+		}
+	}
+
+	*ret_min_angle = result.min_angle;
+	*ret_best_reference = result.best_reference;
+	if (ret_thresh_distance != NULL){
+		*ret_thresh_distance = result.thresh_distance;
+	}
+	return result.belongs;
+}
+
+/**
+ * Write pixel results to the optional outputs. 
+ **/
+void masking_set_output(masking_output_t *output, long sample, bool belongs, float min_angle, unsigned short best_reference){
+	if (output == NULL){
+		return;
+	}
+	if (output->mask != NULL){
+		output->mask[sample] = belongs;
+	}
+	if (output->min_angle != NULL){
+		output->min_angle[sample] = isinf(min_angle) ? NAN : min_angle;
+	}
+	if (output->best_reference != NULL){
+		output->best_reference[sample] = best_reference;
+	}
+}
+
+void masking_thresh_output(masking_t *mask_param, int num_samples, const float *line_data, long sample_stride, long band_stride, mask_thresh_t *ret_thresh, masking_output_t *output){
+	//exact angles are needed when they are output, otherwise reference spectra can be skipped
+	float prune_margin = ((output != NULL) && ((output->min_angle != NULL) || (output->best_reference != NULL))) ? -1 : 0;
+
+	masking_index_refresh_drifted(mask_param);
+	masking_line_state_t state;
+	masking_line_state_init(mask_param, &state);
+	for (int j=0; j < num_samples; j++){
+		float min_angle;
+		unsigned short best_reference;
+		bool belongs = masking_thresh_pixel(mask_param, &state, line_data + j*sample_stride, band_stride, prune_margin, (*ret_thresh)[j], &min_angle, &best_reference, NULL);
+		masking_set_output(output, j, belongs, min_angle, best_reference);
+	}
+	masking_line_state_free(&state);
+}
+
+//lines taking less than this fraction of the target count towards lowering the degradation level
+#define BUDGET_FAST_FRACTION 0.5
+//number of consecutive fast lines before the degradation level is lowered
+#define BUDGET_FAST_LINES 16
+//lower edge of the first latency histogram bin, in seconds, and number of bins per doubling
+#define BUDGET_HISTOGRAM_START 1.0e-6
+#define BUDGET_HISTOGRAM_BINS_PER_DOUBLING 8
+
+void masking_budget_init(masking_budget_t *budget, double target){
+	budget->target = target;
+	budget->level = MASKING_BUDGET_FULL;
+	budget->backlog = 0;
+	budget->num_fast_lines = 0;
+	budget->num_lines = 0;
+	for (int i=0; i < MASKING_BUDGET_NUM_LEVELS; i++){
+		budget->level_count[i] = 0;
+	}
+	for (int i=0; i < MASKING_BUDGET_HISTOGRAM_BINS; i++){
+		budget->histogram[i] = 0;
+	}
+	budget->max_latency = 0;
+}
+
+void masking_budget_record(masking_budget_t *budget, double latency){
+	int bin = 0;
+	if (latency > BUDGET_HISTOGRAM_START){
+		bin = min(MASKING_BUDGET_HISTOGRAM_BINS - 1.0, floor(BUDGET_HISTOGRAM_BINS_PER_DOUBLING*log2(latency/BUDGET_HISTOGRAM_START)));
+	}
+	budget->histogram[bin]++;
+	budget->max_latency = max(budget->max_latency, latency);
+	budget->level_count[budget->level]++;
+	budget->num_lines++;
+
+	//degrade after lines over target, recover slowly once the backlog is cleared
+	budget->backlog = max(0.0, budget->backlog + latency - budget->target);
+	if (latency > budget->target){
+		budget->level = min(budget->level + 1, (int)MASKING_BUDGET_CLASSIFY_ONLY);
+		budget->num_fast_lines = 0;
+	} else if ((budget->backlog == 0) && (latency < BUDGET_FAST_FRACTION*budget->target)){
+		budget->num_fast_lines++;
+		if ((budget->num_fast_lines >= BUDGET_FAST_LINES) && (budget->level > MASKING_BUDGET_FULL)){
+			budget->level--;
+			budget->num_fast_lines = 0;
+		}
+	} else {
+		budget->num_fast_lines = 0;
+	}
+}
+
+void masking_thresh_budget(masking_t *mask_param, masking_budget_t *budget, int num_samples, const float *line_data, long sample_stride, long band_stride, mask_thresh_t *ret_thresh, masking_output_t *output){
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	float prune_margin = ((output != NULL) && ((output->min_angle != NULL) || (output->best_reference != NULL))) ? -1 : 0;
+
+	masking_index_refresh_drifted(mask_param);
+	masking_line_state_t state;
+	masking_line_state_init(mask_param, &state);
+	switch (budget->level){
+		case MASKING_BUDGET_DEFERRED_UPDATES:
+			masking_line_state_defer_updates(mask_param, &state, 1);
+		break;
+		case MASKING_BUDGET_SUBSAMPLED_UPDATES:
+			masking_line_state_defer_updates(mask_param, &state, MASKING_BUDGET_UPDATE_STRIDE);
+		break;
+		case MASKING_BUDGET_CLASSIFY_ONLY:
+			state.use_updated = false;
+			state.update_mode = MASKING_UPDATE_NONE;
+		break;
+	}
+
+	for (int j=0; j < num_samples; j++){
+		float min_angle;
+		unsigned short best_reference;
+		bool belongs = masking_thresh_pixel(mask_param, &state, line_data + j*sample_stride, band_stride, prune_margin, (*ret_thresh)[j], &min_angle, &best_reference, NULL);
+		masking_set_output(output, j, belongs, min_angle, best_reference);
+	}
+	if (state.update_mode == MASKING_UPDATE_DEFERRED){
+		masking_apply_deferred_updates(mask_param, &state);
+	}
+	masking_line_state_free(&state);
+
+	masking_budget_record(budget, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+}
+
+/**
+ * Upper edge of the histogram bin containing the given fraction of the lines. 
+ **/
+double masking_budget_percentile(const masking_budget_t *budget, double fraction){
+	long count = 0;
+	for (int i=0; i < MASKING_BUDGET_HISTOGRAM_BINS; i++){
+		count += budget->histogram[i];
+		if ((count > 0) && (count >= fraction*budget->num_lines)){
+			return min(budget->max_latency, BUDGET_HISTOGRAM_START*pow(2.0, (i + 1.0)/BUDGET_HISTOGRAM_BINS_PER_DOUBLING));
+		}
+	}
+	return budget->max_latency;
+}
+
+void masking_get_budget_stats(const masking_budget_t *budget, masking_budget_stats_t *stats){
+	stats->num_lines = budget->num_lines;
+	stats->p50 = masking_budget_percentile(budget, 0.5);
+	stats->p99 = masking_budget_percentile(budget, 0.99);
+	stats->max = budget->max_latency;
+	for (int i=0; i < MASKING_BUDGET_NUM_LEVELS; i++){
+		stats->level_count[i] = budget->level_count[i];
+	}
+}
+
+void masking_coarse_state_init(const masking_t *mask_param, int num_samples, const masking_coarse_t *coarse, masking_coarse_state_t *state){
+	int block_size = (coarse->block_size > 0) ? coarse->block_size : 1;
+	state->num_blocks = (num_samples + block_size - 1)/block_size;
+	state->num_refs = mask_param->num_masking_spectra;
+	state->has_prev = false;
+	state->prev_belongs = new bool[state->num_blocks];
+	state->has_next = false;
+	state->next_thresh = new bool[state->num_blocks*state->num_refs];
+	state->next_belongs = new bool[state->num_blocks];
+	state->next_min_angle = new float[state->num_blocks];
+	state->next_best_reference = new unsigned short[state->num_blocks];
+	state->next_thresh_distance = new float[state->num_blocks];
+}
+
+void masking_coarse_state_free(masking_coarse_state_t *state){
+	delete [] state->prev_belongs;
+	delete [] state->next_thresh;
+	delete [] state->next_belongs;
+	delete [] state->next_min_angle;
+	delete [] state->next_best_reference;
+	delete [] state->next_thresh_distance;
+}
+
+/**
+ * Classify the center pixel of each block in a block row into the next_* results of the coarse-to-fine state. 
+ * \param row_data First line of block row
+ * \param num_row_lines Number of lines in block row
+ * \return Number of classified pixels
+ **/
+long masking_coarse_classify_centers(masking_t *mask_param, masking_line_state_t *line_state, int num_samples, int block_size, const float *row_data, int num_row_lines, long sample_stride, long band_stride, long line_stride, float prune_margin, masking_coarse_state_t *state){
+	int center_line = (num_row_lines - 1)/2;
+	for (int b=0; b < state->num_blocks; b++){
+		int center_sample = (b*block_size + min((b+1)*block_size, num_samples) - 1)/2;
+		state->next_belongs[b] = masking_thresh_pixel(mask_param, line_state, row_data + center_line*line_stride + center_sample*sample_stride, band_stride, prune_margin, state->next_thresh + b*state->num_refs, state->next_min_angle + b, state->next_best_reference + b, state->next_thresh_distance + b);
+	}
+	state->has_next = true;
+	return state->num_blocks;
+}
+
+long masking_thresh_coarse_to_fine(masking_t *mask_param, int num_samples, int num_lines, const float *block_data, long sample_stride, long band_stride, long line_stride, const masking_coarse_t *coarse, mask_thresh_t *ret_thresh, masking_output_t *output, masking_coarse_state_t *state, int num_next_lines){
+	int block_size = (coarse->block_size > 0) ? coarse->block_size : 1;
+	long num_classified = 0;
+
+	//lines masked on their own use a temporary state
+	masking_coarse_state_t local_state;
+	if (state == NULL){
+		masking_coarse_state_init(mask_param, num_samples, coarse, &local_state);
+		state = &local_state;
+		num_next_lines = 0;
+	}
+	int num_blocks = state->num_blocks;
+	int num_refs = state->num_refs;
+
+	//coarse results of the current block row
+	bool *block_thresh = new bool[num_blocks*num_refs];
+	bool *block_belongs = new bool[num_blocks];
+	float *block_min_angle = new float[num_blocks];
+	unsigned short *block_best_reference = new unsigned short[num_blocks];
+	float *block_thresh_distance = new float[num_blocks];
+	bool *block_refine = new bool[num_blocks];
+
+	//exact angles are needed when they are output. Otherwise reference spectra can be skipped, as long as their distances from the thresholds exceed the margin
+	float prune_margin = ((output != NULL) && ((output->min_angle != NULL) || (output->best_reference != NULL))) ? -1 : max(coarse->angle_margin, 0.0f);
+
+	masking_index_refresh_drifted(mask_param);
+	masking_line_state_t line_state;
+	masking_line_state_init(mask_param, &line_state);
+	if ((num_lines > 0) && !state->has_next){
+		num_classified += masking_coarse_classify_centers(mask_param, &line_state, num_samples, block_size, block_data, min(block_size, num_lines), sample_stride, band_stride, line_stride, prune_margin, state);
+	}
+	for (int start_line=0; start_line < num_lines; start_line += block_size){
+		int end_line = min(start_line + block_size, num_lines);
+		int center_line = (start_line + end_line - 1)/2;
+
+		//center pixels of this block row were classified in advance
+		swap(block_thresh, state->next_thresh);
+		swap(block_belongs, state->next_belongs);
+		swap(block_min_angle, state->next_min_angle);
+		swap(block_best_reference, state->next_best_reference);
+		swap(block_thresh_distance, state->next_thresh_distance);
+		state->has_next = false;
+
+		//classify center pixels of the block row below before writing this one
+		if (end_line < num_lines){
+			num_classified += masking_coarse_classify_centers(mask_param, &line_state, num_samples, block_size, block_data + end_line*line_stride, min(block_size, num_lines - end_line), sample_stride, band_stride, line_stride, prune_margin, state);
+		} else if (num_next_lines > 0){
+			num_classified += masking_coarse_classify_centers(mask_param, &line_state, num_samples, block_size, block_data + num_lines*line_stride, num_next_lines, sample_stride, band_stride, line_stride, prune_margin, state);
+		}
+
+		//blocks bordering blocks with different labels in this, the previous or the next block row are mixed
+		for (int b=0; b < num_blocks; b++){
+			block_refine[b] = !(block_thresh_distance[b] > coarse->angle_margin);
+			if (((b > 0) && (block_belongs[b-1] != block_belongs[b])) || ((b < num_blocks - 1) && (block_belongs[b+1] != block_belongs[b]))){
+				block_refine[b] = true;
+			}
+			if (state->has_prev && (state->prev_belongs[b] != block_belongs[b])){
+				block_refine[b] = true;
+			}
+			if (state->has_next && (state->next_belongs[b] != block_belongs[b])){
+				block_refine[b] = true;
+			}
+		}
+		for (int b=0; b < num_blocks; b++){
+			state->prev_belongs[b] = block_belongs[b];
+		}
+		state->has_prev = true;
+
+		for (int i=start_line; i < end_line; i++){
+			masking_output_t *line_output = (output != NULL) ? output + i : NULL;
+			for (int b=0; b < num_blocks; b++){
+				int center_sample = (b*block_size + min((b+1)*block_size, num_samples) - 1)/2;
+				for (int j=b*block_size; j < min((b+1)*block_size, num_samples); j++){
+					bool *pixel_thresh = ret_thresh[i][j];
+					bool belongs = block_belongs[b];
+					float min_angle = block_min_angle[b];
+					unsigned short best_reference = block_best_reference[b];
+					if (block_refine[b] && ((i != center_line) || (j != center_sample))){
+						//full resolution
+						belongs = masking_thresh_pixel(mask_param, &line_state, block_data + i*line_stride + j*sample_stride, band_stride, prune_margin, pixel_thresh, &min_angle, &best_reference, NULL);
+						num_classified++;
+					} else {
+						//coarse label
+						for (int k=0; k < num_refs; k++){
+							pixel_thresh[k] = block_thresh[b*num_refs + k];
+						}
+					}
+					masking_set_output(line_output, j, belongs, min_angle, best_reference);
+				}
+			}
+		}
+	}
+	masking_line_state_free(&line_state);
+
+	delete [] block_thresh;
+	delete [] block_belongs;
+	delete [] block_min_angle;
+	delete [] block_best_reference;
+	delete [] block_thresh_distance;
+	delete [] block_refine;
+	if (state == &local_state){
+		masking_coarse_state_free(&local_state);
+	}
+	return num_classified;
+}
+
+//tile sizes of the batch kernel: pixels and bands are blocked to keep a tile of pixels in L2 cache, micro tiles of pixels x reference columns are kept in registers
+#define BATCH_PIXEL_TILE 256
+#define BATCH_BAND_TILE 64
+#define BATCH_MICRO_PIXELS 8
+#define BATCH_MICRO_COLUMNS 4
+
+/**
+ * Accumulate dot products between a tile of pixels and packed reference spectra over a range of bands. 
+ * \param num_pixels Number of pixels in tile, at most BATCH_PIXEL_TILE
+ * \param start_band First band
+ * \param end_band One past last band
+ * \param pixels First sample of pixel tile in band 0
+ * \param band_stride Distance in number of floats between consecutive bands
+ * \param num_columns Number of reference columns, multiple of BATCH_MICRO_COLUMNS
+ * \param refs Packed references, num_columns values for each band
+ * \param dots Dot products, BATCH_PIXEL_TILE values for each reference column
+ **/
+void masking_batch_dot_tile(int num_pixels, int start_band, int end_band, const float *pixels, long band_stride, int num_columns, const float *refs, float *dots){
+	for (int c=0; c < num_columns; c += BATCH_MICRO_COLUMNS){
+		for (int p=0; p < num_pixels; p += BATCH_MICRO_PIXELS){
+			float *dot = dots + c*BATCH_PIXEL_TILE + p;
+			float acc[BATCH_MICRO_COLUMNS][BATCH_MICRO_PIXELS];
+			for (int q=0; q < BATCH_MICRO_COLUMNS; q++){
+				for (int r=0; r < BATCH_MICRO_PIXELS; r++){
+					acc[q][r] = dot[q*BATCH_PIXEL_TILE + r];
+				}
+			}
+
+			if (p + BATCH_MICRO_PIXELS <= num_pixels){
+				//full micro tile, fixed trip counts
+				for (int i=start_band; i < end_band; i++){
+					const float *pixel = pixels + i*band_stride + p;
+					const float *ref = refs + i*num_columns + c;
+					for (int q=0; q < BATCH_MICRO_COLUMNS; q++){
+						for (int r=0; r < BATCH_MICRO_PIXELS; r++){
+							acc[q][r] += pixel[r]*ref[q];
+						}
+					}
+				}
+			} else {
+				int num_rest = num_pixels - p;
+				for (int i=start_band; i < end_band; i++){
+					const float *pixel = pixels + i*band_stride + p;
+					const float *ref = refs + i*num_columns + c;
+					for (int q=0; q < BATCH_MICRO_COLUMNS; q++){
+						for (int r=0; r < num_rest; r++){
+							acc[q][r] += pixel[r]*ref[q];
+						}
+					}
+				}
+			}
+
+			for (int q=0; q < BATCH_MICRO_COLUMNS; q++){
+				for (int r=0; r < BATCH_MICRO_PIXELS; r++){
+					dot[q*BATCH_PIXEL_TILE + r] = acc[q][r];
+				}
+			}
+		}
+	}
+}
+
+void masking_thresh_batch(masking_t *mask_param, int num_samples, int num_lines, const float *block_data, mask_thresh_t *ret_thresh, masking_output_t *output){
+	int num_refs = mask_param->num_masking_spectra;
+	int num_bands = mask_param->num_bands;
+	long band_stride = num_samples;
+	long line_stride = band_stride*num_bands;
+
+	masking_index_refresh_drifted(mask_param);
+	masking_line_state_t state;
+	masking_line_state_init(mask_param, &state);
+
+	//pack original and updated spectra as columns 2k and 2k+1, padded with zero columns to a multiple of the micro tile
+	int num_columns = ((2*num_refs + BATCH_MICRO_COLUMNS - 1)/BATCH_MICRO_COLUMNS)*BATCH_MICRO_COLUMNS;
+	float *refs = new float[(long)num_bands*num_columns]();
+	for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+		for (int k=0; k < num_refs; k++){
+			refs[i*num_columns + 2*k] = mask_param->orig_spectra[k][i];
+			refs[i*num_columns + 2*k + 1] = mask_param->updated_spectra[k][i];
+		}
+	}
+
+	float *dots = new float[num_columns*BATCH_PIXEL_TILE];
+	float *pixel_norms = new float[BATCH_PIXEL_TILE];
+
+	//acos is decreasing, so angle < thresh is equivalent to cos > cos(thresh)
+	bool calculate_angles = (output != NULL) && ((output->min_angle != NULL) || (output->best_reference != NULL));
+	float *cos_thresh = new float[num_refs];
+	for (int k=0; k < num_refs; k++){
+		cos_thresh[k] = cos(mask_param->sam_thresh[k]);
+	}
+
+	for (int l=0; l < num_lines; l++){
+		const float *line_data = block_data + l*line_stride;
+		masking_output_t *line_output = (output != NULL) ? output + l : NULL;
+		for (int start_sample=0; start_sample < num_samples; start_sample += BATCH_PIXEL_TILE){
+			int num_pixels = min(BATCH_PIXEL_TILE, num_samples - start_sample);
+			const float *pixels = line_data + start_sample;
+
+			//pixel norms, accumulated in the same band order as in masking_thresh_pixel()
+			for (int p=0; p < num_pixels; p++){
+				pixel_norms[p] = 0;
+			}
 			for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
-				samval_orig += pixel_vals[i]*mask_param->orig_spectra[k][i];
-				samval_updated += pixel_vals[i]*mask_param->updated_spectra[k][i];
-			}
-			samval_orig /= pixel_norm*ref_norms_orig[k];
-			samval_orig = acos(samval_orig);
-			samval_updated /= pixel_norm*ref_norms_updated[k];
-			samval_updated = acos(samval_updated);
-
-			//compare against thresholds, save to return array in separate slots
-			bool pixel_belong = (samval_orig < mask_param->sam_thresh[k]) || (samval_updated < mask_param->sam_thresh[k]);
-			(*ret_thresh)[j][k] = pixel_belong;
-
-			//update the updated spectra with new information if above threshold
-			if (pixel_belong){
-				long n = mask_param->num_samples_in_spectra[k];
-				n++;
-				ref_norms_updated[k] = 0;
-				for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
-					double delta = pixel_vals[i] - mask_param->updated_spectra[k][i];
-
-					//update reference spectrum
-					mask_param->updated_spectra[k][i] += delta/(n*1.0);
-
-					//update norm of reference spectrum
-					ref_norms_updated[k] += mask_param->updated_spectra[k][i]*mask_param->updated_spectra[k][i];
+				for (int p=0; p < num_pixels; p++){
+					pixel_norms[p] += pixels[i*band_stride + p]*pixels[i*band_stride + p];
 				}
-				ref_norms_updated[k] = sqrt(ref_norms_updated[k]);
-				mask_param->num_samples_in_spectra[k] = n;
+			}
+			for (int p=0; p < num_pixels; p++){
+				pixel_norms[p] = sqrt(pixel_norms[p]);
+			}
+
+			//dot products, blocked over bands
+			memset(dots, 0, sizeof(float)*num_columns*BATCH_PIXEL_TILE);
+			for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i += BATCH_BAND_TILE){
+				int end_band = min(i + BATCH_BAND_TILE, mask_param->end_band_ind + 1);
+				masking_batch_dot_tile(num_pixels, i, end_band, pixels, band_stride, num_columns, refs, dots);
+			}
+
+			//threshold, SAM angles are only calculated when they are output
+			for (int p=0; p < num_pixels; p++){
+				bool *pixel_thresh = ret_thresh[l][start_sample + p];
+				masking_pixel_result_t result;
+				result.belongs = false;
+				result.min_angle = INFINITY;
+				result.best_reference = 0;
+				for (int k=0; k < num_refs; k++){
+					float cos_orig = dots[2*k*BATCH_PIXEL_TILE + p]/(pixel_norms[p]*state.ref_norms_orig[k]);
+					float cos_updated = dots[(2*k + 1)*BATCH_PIXEL_TILE + p]/(pixel_norms[p]*state.ref_norms_updated[k]);
+					bool pixel_belong = (cos_orig > cos_thresh[k]) || (cos_updated > cos_thresh[k]);
+					pixel_thresh[k] = pixel_belong;
+					result.belongs = result.belongs || pixel_belong;
+
+					if (calculate_angles){
+						float angle = fmin(acos(cos_orig), acos(cos_updated));
+						if (angle < result.min_angle){
+							result.min_angle = angle;
+							result.best_reference = k;
+						}
+					}
+				}
+				masking_set_output(line_output, start_sample + p, result.belongs, result.min_angle, result.best_reference);
 			}
 		}
-		delete [] pixel_vals;
 	}
-	delete [] ref_norms_orig;
-	delete [] ref_norms_updated;
+
+	//update the updated spectra in pixel order
+	for (int l=0; l < num_lines; l++){
+		const float *line_data = block_data + l*line_stride;
+		for (int j=0; j < num_samples; j++){
+			bool *pixel_thresh = ret_thresh[l][j];
+			bool gathered = false;
+			for (int k=0; k < num_refs; k++){
+				if (!pixel_thresh[k]){
+					continue;
+				}
+				if (!gathered){
+					for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+						state.pixel_vals[i] = line_data[i*band_stride + j];
+					}
+					gathered = true;
+				}
+				masking_update_reference(mask_param, &state, k);
+			}
+		}
+	}
+
+	delete [] refs;
+	delete [] dots;
+	delete [] pixel_norms;
+	delete [] cos_thresh;
+	masking_line_state_free(&state);
+}
+
+void masking_merge_state(masking_t *mask_param, int num_states, const masking_t *states){
+	double *sum = new double[mask_param->num_bands];
+	for (int k=0; k < mask_param->num_masking_spectra; k++){
+		//sufficient statistics of the common starting point
+		long n_base = mask_param->num_samples_in_spectra[k];
+		long n = n_base;
+		for (int i=0; i < mask_param->num_bands; i++){
+			sum[i] = n_base*(double)mask_param->updated_spectra[k][i];
+		}
+
+		//add the samples contributed by each state on top of the starting point
+		for (int s=0; s < num_states; s++){
+			long n_state = states[s].num_samples_in_spectra[k];
+			if (n_state <= n_base){
+				continue;
+			}
+			for (int i=0; i < mask_param->num_bands; i++){
+				sum[i] += n_state*(double)states[s].updated_spectra[k][i] - n_base*(double)mask_param->updated_spectra[k][i];
+			}
+			n += n_state - n_base;
+		}
+
+		if (n > n_base){
+			for (int i=0; i < mask_param->num_bands; i++){
+				mask_param->updated_spectra[k][i] = sum[i]/(n*1.0);
+			}
+			mask_param->num_samples_in_spectra[k] = n;
+		}
+	}
+	delete [] sum;
+	if (masking_index_usable(mask_param)){
+		masking_index_refresh(mask_param);
+	}
 }
 
 mask_thresh_t masking_allocate_thresh(const masking_t *mask_param, int num_samples){
@@ -0,0 +1,210 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "masking_index.h"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+float masking_index_angle(const masking_index_t *index, int node, const float *vals, float norm){
+	const float *center = &(index->centers[node][0]);
+	float dot = 0;
+	for (int i=index->start_band_ind; i <= index->end_band_ind; i++){
+		dot += vals[i]*center[i];
+	}
+	return acos(max(-1.0f, min(1.0f, dot/norm)));
+}
+
+/**
+ * Norm of spectrum over the band range of the index. 
+ **/
+float masking_index_norm(const masking_index_t *index, const float *vals){
+	float norm = 0;
+	for (int i=index->start_band_ind; i <= index->end_band_ind; i++){
+		norm += vals[i]*vals[i];
+	}
+	return sqrt(norm);
+}
+
+/**
+ * Angle between two spectra over the band range of the index. 
+ **/
+float masking_index_spectra_angle(const masking_index_t *index, const float *vals_1, const float *vals_2){
+	float dot = 0;
+	for (int i=index->start_band_ind; i <= index->end_band_ind; i++){
+		dot += vals_1[i]*vals_2[i];
+	}
+	return acos(max(-1.0f, min(1.0f, dot/(masking_index_norm(index, vals_1)*masking_index_norm(index, vals_2)))));
+}
+
+/**
+ * Recursively build node over refs[ref_start, ref_end). 
+ * \return Node index
+ **/
+int masking_index_build_node(const masking_t *mask_param, masking_index_t *index, int ref_start, int ref_end, int parent){
+	int node = index->centers.size();
+	index->centers.push_back(vector<float>(mask_param->num_bands, 0.0f));
+	index->radius.push_back(0);
+	index->max_thresh.push_back(0);
+	index->left.push_back(-1);
+	index->right.push_back(-1);
+	index->parent.push_back(parent);
+	index->ref_start.push_back(ref_start);
+	index->ref_end.push_back(ref_end);
+
+	//center: normalized mean of the normalized spectra
+	vector<float> center(mask_param->num_bands, 0.0f);
+	for (int r=ref_start; r < ref_end; r++){
+		const float *spectrum = mask_param->orig_spectra[index->refs[r]];
+		float norm = masking_index_norm(index, spectrum);
+		for (int i=index->start_band_ind; i <= index->end_band_ind; i++){
+			center[i] += spectrum[i]/norm;
+		}
+	}
+	float norm = masking_index_norm(index, &center[0]);
+	for (int i=index->start_band_ind; i <= index->end_band_ind; i++){
+		center[i] /= norm;
+	}
+	index->centers[node] = center;
+
+	if (ref_end - ref_start <= MASKING_INDEX_LEAF_SIZE){
+		for (int r=ref_start; r < ref_end; r++){
+			index->leaf_of_ref[index->refs[r]] = node;
+		}
+		return node;
+	}
+
+	//split around the two spectra farthest apart: first the farthest from an arbitrary spectrum, then the farthest from that one
+	int seed_1 = ref_start;
+	float max_angle = -1;
+	for (int r=ref_start; r < ref_end; r++){
+		float angle = masking_index_spectra_angle(index, mask_param->orig_spectra[index->refs[ref_start]], mask_param->orig_spectra[index->refs[r]]);
+		if (angle > max_angle){
+			max_angle = angle;
+			seed_1 = r;
+		}
+	}
+	int seed_2 = ref_start;
+	max_angle = -1;
+	for (int r=ref_start; r < ref_end; r++){
+		float angle = masking_index_spectra_angle(index, mask_param->orig_spectra[index->refs[seed_1]], mask_param->orig_spectra[index->refs[r]]);
+		if (angle > max_angle){
+			max_angle = angle;
+			seed_2 = r;
+		}
+	}
+	const float *spectrum_1 = mask_param->orig_spectra[index->refs[seed_1]];
+	const float *spectrum_2 = mask_param->orig_spectra[index->refs[seed_2]];
+
+	//partition by closest seed, split in half if the partition degenerates
+	int *refs = &(index->refs[0]);
+	int *middle = stable_partition(refs + ref_start, refs + ref_end, [&](int ref){
+		return masking_index_spectra_angle(index, mask_param->orig_spectra[ref], spectrum_1) <= masking_index_spectra_angle(index, mask_param->orig_spectra[ref], spectrum_2);
+	});
+	int ref_middle = middle - refs;
+	if ((ref_middle == ref_start) || (ref_middle == ref_end)){
+		ref_middle = (ref_start + ref_end)/2;
+	}
+
+	int left = masking_index_build_node(mask_param, index, ref_start, ref_middle, node);
+	int right = masking_index_build_node(mask_param, index, ref_middle, ref_end, node);
+	index->left[node] = left;
+	index->right[node] = right;
+	return node;
+}
+
+/**
+ * Recalculate node radii, thresholds and the drift starting points of index from the spectra and thresholds in mask_param. 
+ **/
+void masking_index_refresh_bounds(const masking_t *mask_param, masking_index_t *index){
+	for (int node=0; node < (int)index->centers.size(); node++){
+		float radius = 0;
+		float max_thresh = -INFINITY;
+		for (int r=index->ref_start[node]; r < index->ref_end[node]; r++){
+			int ref = index->refs[r];
+			radius = max(radius, masking_index_angle(index, node, mask_param->orig_spectra[ref], masking_index_norm(index, mask_param->orig_spectra[ref])));
+			radius = max(radius, masking_index_angle(index, node, mask_param->updated_spectra[ref], masking_index_norm(index, mask_param->updated_spectra[ref])));
+			max_thresh = max(max_thresh, mask_param->sam_thresh[ref]);
+		}
+		index->radius[node] = radius;
+		index->max_thresh[node] = max_thresh;
+	}
+
+	//angles between updated spectra and their nodes, the starting point for tracking drift
+	for (int ref=0; ref < mask_param->num_masking_spectra; ref++){
+		const float *spectrum = mask_param->updated_spectra[ref];
+		float norm = masking_index_norm(index, spectrum);
+		index->ref_angles[ref].clear();
+		for (int node = index->leaf_of_ref[ref]; node >= 0; node = index->parent[node]){
+			index->ref_angles[ref].push_back(masking_index_angle(index, node, spectrum, norm));
+		}
+		index->ref_drift[ref] = 0;
+	}
+}
+
+masking_index_t *masking_index_build(const masking_t *mask_param){
+	if (mask_param->num_masking_spectra <= MASKING_INDEX_LEAF_SIZE){
+		return NULL;
+	}
+
+	masking_index_t *index = new masking_index_t;
+	index->start_band_ind = mask_param->start_band_ind;
+	index->end_band_ind = mask_param->end_band_ind;
+	index->leaf_of_ref.resize(mask_param->num_masking_spectra);
+	index->ref_angles.resize(mask_param->num_masking_spectra);
+	index->ref_drift.resize(mask_param->num_masking_spectra, 0);
+	for (int k=0; k < mask_param->num_masking_spectra; k++){
+		index->refs.push_back(k);
+	}
+	masking_index_build_node(mask_param, index, 0, mask_param->num_masking_spectra, -1);
+	masking_index_refresh_bounds(mask_param, index);
+	return index;
+}
+
+masking_index_t *masking_index_copy(const masking_index_t *index){
+	if (index == NULL){
+		return NULL;
+	}
+	return new masking_index_t(*index);
+}
+
+void masking_index_free(masking_index_t *index){
+	delete index;
+}
+
+bool masking_index_usable(const masking_t *mask_param){
+	const masking_index_t *index = mask_param->index;
+	return (index != NULL) && (index->start_band_ind == mask_param->start_band_ind) && (index->end_band_ind == mask_param->end_band_ind);
+}
+
+void masking_index_refresh(masking_t *mask_param){
+	masking_index_refresh_bounds(mask_param, mask_param->index);
+}
+
+void masking_index_refresh_drifted(masking_t *mask_param){
+	if (!masking_index_usable(mask_param)){
+		return;
+	}
+	const masking_index_t *index = mask_param->index;
+	for (int ref=0; ref < mask_param->num_masking_spectra; ref++){
+		if (index->ref_drift[ref] > MASKING_INDEX_SLACK){
+			masking_index_refresh(mask_param);
+			return;
+		}
+	}
+}
+
+void masking_index_update_reference(masking_t *mask_param, int ref, double angle){
+	//by the triangle inequality, the spectrum is at most (angle at refresh + total drift) from each node center
+	masking_index_t *index = mask_param->index;
+	index->ref_drift[ref] += angle;
+	int level = 0;
+	for (int node = index->leaf_of_ref[ref]; node >= 0; node = index->parent[node]){
+		index->radius[node] = max(index->radius[node], (float)(index->ref_angles[ref][level] + index->ref_drift[ref]));
+		level++;
+	}
+}
@@ -0,0 +1,108 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef MASKING_INDEX_H_DEFINED
+#define MASKING_INDEX_H_DEFINED
+
+#include "masking.h"
+#include <vector>
+
+/**
+ * Maximum number of reference spectra in a leaf of the index. Libraries that fit in one leaf are not indexed. 
+ **/
+#define MASKING_INDEX_LEAF_SIZE 8
+
+/**
+ * Slack added to the angular bounds to absorb rounding errors, in radians. 
+ **/
+#define MASKING_INDEX_SLACK 0.01f
+
+/**
+ * Cone tree over the reference spectra on the unit hypersphere. Each node has a unit center vector and a radius, 
+ * the largest angle between the center and any original or updated reference spectrum below the node. 
+ * By the triangle inequality for angles, no spectrum below the node has a smaller SAM angle to a pixel than (angle to center - radius). 
+ **/
+struct masking_index{
+	/// Band range the index was built for
+	int start_band_ind;
+	int end_band_ind;
+	/// Unit center vector of each node, num_bands values
+	std::vector<std::vector<float> > centers;
+	/// Angular radius of each node
+	std::vector<float> radius;
+	/// Largest SAM threshold of the reference spectra below each node
+	std::vector<float> max_thresh;
+	/// Child nodes, -1 for leaves
+	std::vector<int> left;
+	std::vector<int> right;
+	/// Parent node, -1 for root
+	std::vector<int> parent;
+	/// Range in refs of the reference spectra below each node
+	std::vector<int> ref_start;
+	std::vector<int> ref_end;
+	/// Reference spectrum indices, ordered by leaf
+	std::vector<int> refs;
+	/// Leaf containing each reference spectrum
+	std::vector<int> leaf_of_ref;
+	/// Angle between each updated spectrum and the centers of the nodes containing it at last refresh, from leaf to root
+	std::vector<std::vector<float> > ref_angles;
+	/// Upper bound on the angle each updated spectrum has moved since last refresh
+	std::vector<double> ref_drift;
+};
+
+/**
+ * Build index over the original reference spectra. 
+ * \return Index, or NULL if the library is too small to benefit from an index
+ **/
+masking_index_t *masking_index_build(const masking_t *mask_param);
+
+/**
+ * Copy index. 
+ * \return Copy, or NULL if index is NULL
+ **/
+masking_index_t *masking_index_copy(const masking_index_t *index);
+
+/**
+ * Free index. 
+ **/
+void masking_index_free(masking_index_t *index);
+
+/**
+ * Whether the index can be used with the current masking parameters. 
+ **/
+bool masking_index_usable(const masking_t *mask_param);
+
+/**
+ * Recalculate node radii and thresholds from the current original and updated spectra and thresholds. Needed after changing 
+ * updated spectra or thresholds other than through masking_index_update_reference(). 
+ **/
+void masking_index_refresh(masking_t *mask_param);
+
+/**
+ * Refresh the index if an updated spectrum has drifted more than MASKING_INDEX_SLACK since the last refresh, so that the radii 
+ * enlarged by masking_index_update_reference() are tightened again. Does nothing if the index is not usable. 
+ **/
+void masking_index_refresh_drifted(masking_t *mask_param);
+
+/**
+ * Enlarge node radii to cover the updated spectrum of the given reference after it has changed. 
+ * \param mask_param Masking parameters
+ * \param ref Reference spectrum index
+ * \param angle Angle between the updated spectrum before and after the change
+ **/
+void masking_index_update_reference(masking_t *mask_param, int ref, double angle);
+
+/**
+ * Angle between input vector and center of node. 
+ * \param index Index
+ * \param node Node
+ * \param vals Input vector
+ * \param norm Norm of input vector
+ **/
+float masking_index_angle(const masking_index_t *index, int node, const float *vals, float norm);
+
+#endif
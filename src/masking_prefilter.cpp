@@ -0,0 +1,184 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "masking_prefilter.h"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+/**
+ * Squared residual of the normalized reference spectra after projection onto a band group, from prefix sums.
+ * \param sums Prefix sums of the normalized spectra, num_bands + 1 values for each reference spectrum
+ * \param square_sums Prefix sums of the squared normalized spectra
+ * \param start First band of group
+ * \param end One past last band of group
+ **/
+double masking_prefilter_group_residual(const vector<vector<double> > &sums, const vector<vector<double> > &square_sums, int start, int end){
+	double residual = 0;
+	for (size_t k=0; k < sums.size(); k++){
+		double sum = sums[k][end] - sums[k][start];
+		residual += square_sums[k][end] - square_sums[k][start] - sum*sum/(end - start);
+	}
+	return residual;
+}
+
+masking_prefilter_t *masking_prefilter_build(const masking_t *mask_param, int num_groups){
+	if (num_groups <= 0){
+		return NULL;
+	}
+	int num_bands = mask_param->num_bands;
+
+	//prefix sums of the normalized original spectra
+	vector<vector<double> > sums(mask_param->num_masking_spectra, vector<double>(num_bands + 1, 0));
+	vector<vector<double> > square_sums(mask_param->num_masking_spectra, vector<double>(num_bands + 1, 0));
+	for (int k=0; k < mask_param->num_masking_spectra; k++){
+		double norm = 0;
+		for (int i=0; i < num_bands; i++){
+			norm += (double)mask_param->orig_spectra[k][i]*mask_param->orig_spectra[k][i];
+		}
+		norm = (norm > 0) ? sqrt(norm) : 1;
+		for (int i=0; i < num_bands; i++){
+			double val = mask_param->orig_spectra[k][i]/norm;
+			sums[k][i+1] = sums[k][i] + val;
+			square_sums[k][i+1] = square_sums[k][i] + val*val;
+		}
+	}
+
+	//split the group and position that reduces the residual the most until there are enough groups
+	masking_prefilter_t *prefilter = new masking_prefilter_t;
+	prefilter->num_tested = 0;
+	prefilter->num_rejected = 0;
+	prefilter->group_start.push_back(0);
+	prefilter->group_start.push_back(num_bands);
+	while ((int)prefilter->group_start.size() - 1 < num_groups){
+		double best_reduction = 0;
+		int best_split = -1;
+		for (size_t g=0; g + 1 < prefilter->group_start.size(); g++){
+			int start = prefilter->group_start[g];
+			int end = prefilter->group_start[g+1];
+			double residual = masking_prefilter_group_residual(sums, square_sums, start, end);
+			for (int split=start+1; split < end; split++){
+				double reduction = residual - masking_prefilter_group_residual(sums, square_sums, start, split) - masking_prefilter_group_residual(sums, square_sums, split, end);
+				if (reduction > best_reduction){
+					best_reduction = reduction;
+					best_split = split;
+				}
+			}
+		}
+		if (best_split < 0){
+			break;
+		}
+		prefilter->group_start.insert(upper_bound(prefilter->group_start.begin(), prefilter->group_start.end(), best_split), best_split);
+	}
+	return prefilter;
+}
+
+masking_prefilter_t *masking_prefilter_copy(const masking_prefilter_t *prefilter){
+	if (prefilter == NULL){
+		return NULL;
+	}
+	return new masking_prefilter_t(*prefilter);
+}
+
+void masking_prefilter_free(masking_prefilter_t *prefilter){
+	delete prefilter;
+}
+
+/**
+ * Projection coefficients and residual norm of a normalized spectrum.
+ * \param state Pre-filter data, containing the group band ranges
+ * \param vals Spectrum
+ * \param norm Norm of spectrum
+ * \param proj Output projection coefficients
+ * \return Residual norm
+ **/
+double masking_prefilter_project(const masking_prefilter_state_t *state, const float *vals, double norm, double *proj){
+	double proj_norm = 0;
+	for (size_t g=0; g < state->start.size(); g++){
+		double sum = 0;
+		for (int i=state->start[g]; i < state->end[g]; i++){
+			sum += vals[i];
+		}
+		proj[g] = sum/(sqrt(state->end[g] - state->start[g])*norm);
+		proj_norm += proj[g]*proj[g];
+	}
+	return sqrt(max(0.0, 1.0 - proj_norm));
+}
+
+/**
+ * Norm of spectrum over the current band range.
+ **/
+double masking_prefilter_norm(const masking_t *mask_param, const float *vals){
+	double norm = 0;
+	for (int i=mask_param->start_band_ind; i <= mask_param->end_band_ind; i++){
+		norm += (double)vals[i]*vals[i];
+	}
+	return sqrt(norm);
+}
+
+void masking_prefilter_state_init(const masking_t *mask_param, masking_prefilter_state_t *state){
+	const masking_prefilter_t *prefilter = mask_param->prefilter;
+	state->start.clear();
+	state->end.clear();
+	for (size_t g=0; g + 1 < prefilter->group_start.size(); g++){
+		int start = max(prefilter->group_start[g], mask_param->start_band_ind);
+		int end = min(prefilter->group_start[g+1], mask_param->end_band_ind + 1);
+		if (start < end){
+			state->start.push_back(start);
+			state->end.push_back(end);
+		}
+	}
+
+	int num_groups = state->start.size();
+	state->ref_proj_orig.resize(mask_param->num_masking_spectra*num_groups);
+	state->ref_proj_updated.resize(mask_param->num_masking_spectra*num_groups);
+	state->ref_resid_orig.resize(mask_param->num_masking_spectra);
+	state->ref_resid_updated.resize(mask_param->num_masking_spectra);
+	state->cos_reject.resize(mask_param->num_masking_spectra);
+	state->pixel_proj.resize(num_groups);
+	for (int k=0; k < mask_param->num_masking_spectra; k++){
+		state->ref_resid_orig[k] = masking_prefilter_project(state, mask_param->orig_spectra[k], masking_prefilter_norm(mask_param, mask_param->orig_spectra[k]), &(state->ref_proj_orig[k*num_groups]));
+		masking_prefilter_update_reference(mask_param, state, k);
+		state->cos_reject[k] = cos(min((double)mask_param->sam_thresh[k] + MASKING_PREFILTER_SLACK, M_PI));
+	}
+}
+
+void masking_prefilter_update_reference(const masking_t *mask_param, masking_prefilter_state_t *state, int ref){
+	int num_groups = state->start.size();
+	const float *spectrum = mask_param->updated_spectra[ref];
+	state->ref_resid_updated[ref] = masking_prefilter_project(state, spectrum, masking_prefilter_norm(mask_param, spectrum), &(state->ref_proj_updated[ref*num_groups]));
+}
+
+/**
+ * Upper bound on the cosine of the SAM angle between the current pixel and a reference spectrum.
+ **/
+double masking_prefilter_cos_bound(const masking_prefilter_state_t *state, const double *ref_proj, double ref_resid, double pixel_resid){
+	double bound = ref_resid*pixel_resid;
+	for (size_t g=0; g < state->pixel_proj.size(); g++){
+		bound += ref_proj[g]*state->pixel_proj[g];
+	}
+	return bound;
+}
+
+bool masking_prefilter_reject(masking_t *mask_param, masking_prefilter_state_t *state, const float *pixel_vals, float pixel_norm){
+	int num_groups = state->start.size();
+	double pixel_resid = masking_prefilter_project(state, pixel_vals, pixel_norm, &(state->pixel_proj[0]));
+
+	//NaN bounds never reject
+	bool reject = true;
+	for (int k=0; (k < mask_param->num_masking_spectra) && reject; k++){
+		double bound_orig = masking_prefilter_cos_bound(state, &(state->ref_proj_orig[k*num_groups]), state->ref_resid_orig[k], pixel_resid);
+		double bound_updated = masking_prefilter_cos_bound(state, &(state->ref_proj_updated[k*num_groups]), state->ref_resid_updated[k], pixel_resid);
+		reject = (bound_orig < state->cos_reject[k]) && (bound_updated < state->cos_reject[k]);
+	}
+
+	mask_param->prefilter->num_tested++;
+	if (reject){
+		mask_param->prefilter->num_rejected++;
+	}
+	return reject;
+}
@@ -0,0 +1,93 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef MASKING_PREFILTER_H_DEFINED
+#define MASKING_PREFILTER_H_DEFINED
+
+#include "masking.h"
+#include <vector>
+
+/**
+ * Slack added to the thresholds before rejecting a pixel, to absorb rounding errors, in radians.
+ **/
+#define MASKING_PREFILTER_SLACK 0.01f
+
+/**
+ * Pre-filter over contiguous band groups. Spectra are projected orthogonally onto the vectors that are constant within each group.
+ * For pixel x and reference spectrum r with projections Px and Pr, x.r = Px.Pr + (x - Px).(r - Pr) <= Px.Pr + |x - Px||r - Pr|,
+ * which bounds the cosine of the SAM angle from above using only the group sums and norms of the spectra.
+ **/
+struct masking_prefilter{
+	/// First band of each group, followed by one past the last band. Groups cover all bands
+	std::vector<int> group_start;
+	/// Number of pixels tested
+	long num_tested;
+	/// Number of pixels rejected
+	long num_rejected;
+};
+
+/**
+ * Build pre-filter from the original reference spectra. Group boundaries are placed greedily where they reduce the
+ * residuals of the reference spectra the most.
+ * \param mask_param Masking parameters
+ * \param num_groups Maximum number of band groups
+ * \return Pre-filter, or NULL if num_groups is not positive
+ **/
+masking_prefilter_t *masking_prefilter_build(const masking_t *mask_param, int num_groups);
+
+/**
+ * Copy pre-filter.
+ * \return Copy, or NULL if prefilter is NULL
+ **/
+masking_prefilter_t *masking_prefilter_copy(const masking_prefilter_t *prefilter);
+
+/**
+ * Free pre-filter.
+ **/
+void masking_prefilter_free(masking_prefilter_t *prefilter);
+
+/**
+ * Pre-filter data for the current band range and reference spectra, used while masking a line.
+ **/
+typedef struct{
+	/// Band range of each group, clipped to the current band range. Empty groups are left out
+	std::vector<int> start;
+	std::vector<int> end;
+	/// Projection coefficients of the normalized original and updated spectra, num_groups values for each reference spectrum
+	std::vector<double> ref_proj_orig;
+	std::vector<double> ref_proj_updated;
+	/// Residual norms of the normalized original and updated spectra
+	std::vector<double> ref_resid_orig;
+	std::vector<double> ref_resid_updated;
+	/// Cosine of each threshold plus slack, cosines below this cannot pass the threshold
+	std::vector<double> cos_reject;
+	/// Projection coefficients of current pixel
+	std::vector<double> pixel_proj;
+} masking_prefilter_state_t;
+
+/**
+ * Set up pre-filter data for the current band range, reference spectra and thresholds.
+ **/
+void masking_prefilter_state_init(const masking_t *mask_param, masking_prefilter_state_t *state);
+
+/**
+ * Update pre-filter data after the updated spectrum of the given reference has changed.
+ **/
+void masking_prefilter_update_reference(const masking_t *mask_param, masking_prefilter_state_t *state, int ref);
+
+/**
+ * Check whether the SAM angles of the pixel against all original and updated reference spectra provably exceed the thresholds.
+ * Updates the pre-filter statistics.
+ * \param mask_param Masking parameters
+ * \param state Pre-filter data
+ * \param pixel_vals Pixel band values
+ * \param pixel_norm Norm of pixel spectrum
+ * \return true if the pixel cannot belong to the segmented image
+ **/
+bool masking_prefilter_reject(masking_t *mask_param, masking_prefilter_state_t *state, const float *pixel_vals, float pixel_norm);
+
+#endif
@@ -0,0 +1,328 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "postprocess.h"
+#include <algorithm>
+using namespace std;
+
+void morphology_init(morphology_filter_t *filter, morphology_op_t op, int num_samples, int radius){
+	filter->op = op;
+	filter->radius = radius;
+	filter->num_samples = num_samples;
+	filter->num_lines_in = 0;
+	filter->num_lines_out = 0;
+	filter->window = new unsigned char*[2*radius + 1];
+	for (int i=0; i < 2*radius + 1; i++){
+		filter->window[i] = new unsigned char[num_samples]();
+	}
+}
+
+void morphology_free(morphology_filter_t *filter){
+	for (int i=0; i < 2*filter->radius + 1; i++){
+		delete [] filter->window[i];
+	}
+	delete [] filter->window;
+}
+
+/**
+ * Apply morphological operation from the number of set pixels within the structuring element. 
+ * \param op Operation
+ * \param count Number of set pixels within the structuring element
+ * \param num_in_window Number of pixels of the structuring element that are within the image
+ **/
+unsigned char morphology_apply(morphology_op_t op, int count, int num_in_window){
+	if (op == MORPHOLOGY_ERODE){
+		return count == num_in_window;
+	} else {
+		return count > 0;
+	}
+}
+
+/**
+ * Filter line along the sample direction, using a running count of set pixels. 
+ **/
+void morphology_filter_horizontal(const morphology_filter_t *filter, const unsigned char *line, unsigned char *ret_line){
+	int r = filter->radius;
+	int n = filter->num_samples;
+	int count = 0;
+	for (int j=0; j < min(r, n); j++){
+		count += line[j] != 0;
+	}
+	for (int j=0; j < n; j++){
+		//slide window [j - r, j + r]
+		if (j + r < n){
+			count += line[j + r] != 0;
+		}
+		if (j - r - 1 >= 0){
+			count -= line[j - r - 1] != 0;
+		}
+		int num_in_window = min(j + r, n - 1) - max(j - r, 0) + 1;
+		ret_line[j] = morphology_apply(filter->op, count, num_in_window);
+	}
+}
+
+/**
+ * Produce next output line from the lines in the window, ignoring lines that are outside the image or not yet received. 
+ **/
+void morphology_filter_vertical(morphology_filter_t *filter, unsigned char *ret_line){
+	int window_size = 2*filter->radius + 1;
+	long line = filter->num_lines_out;
+	long start_line = max(line - filter->radius, 0L);
+	long end_line = min(line + filter->radius, filter->num_lines_in - 1);
+	int num_in_window = end_line - start_line + 1;
+
+	for (int j=0; j < filter->num_samples; j++){
+		int count = 0;
+		for (long i=start_line; i <= end_line; i++){
+			count += filter->window[i % window_size][j];
+		}
+		ret_line[j] = morphology_apply(filter->op, count, num_in_window);
+	}
+	filter->num_lines_out++;
+}
+
+bool morphology_push_line(morphology_filter_t *filter, const unsigned char *line, unsigned char *ret_line){
+	int window_size = 2*filter->radius + 1;
+	morphology_filter_horizontal(filter, line, filter->window[filter->num_lines_in % window_size]);
+	filter->num_lines_in++;
+
+	//output line is ready when all lines within the structuring element have been received
+	if (filter->num_lines_in - 1 >= filter->num_lines_out + filter->radius){
+		morphology_filter_vertical(filter, ret_line);
+		return true;
+	}
+	return false;
+}
+
+bool morphology_flush_line(morphology_filter_t *filter, unsigned char *ret_line){
+	if (filter->num_lines_out < filter->num_lines_in){
+		morphology_filter_vertical(filter, ret_line);
+		return true;
+	}
+	return false;
+}
+
+void mask_labeler_init(mask_labeler_t *labeler, int num_samples){
+	labeler->num_samples = num_samples;
+	labeler->num_lines = 0;
+	labeler->prev_labels = new int[num_samples];
+	labeler->curr_labels = new int[num_samples];
+	for (int j=0; j < num_samples; j++){
+		labeler->prev_labels[j] = -1;
+		labeler->curr_labels[j] = -1;
+	}
+	labeler->parent.clear();
+	labeler->regions.clear();
+	labeler->completed.clear();
+}
+
+void mask_labeler_free(mask_labeler_t *labeler){
+	delete [] labeler->prev_labels;
+	delete [] labeler->curr_labels;
+}
+
+/**
+ * Find root label, with path compression. 
+ **/
+int mask_labeler_find(mask_labeler_t *labeler, int label){
+	int root = label;
+	while (labeler->parent[root] != root){
+		root = labeler->parent[root];
+	}
+	while (labeler->parent[label] != root){
+		int next = labeler->parent[label];
+		labeler->parent[label] = root;
+		label = next;
+	}
+	return root;
+}
+
+/**
+ * Join two labels, merge their region statistics. 
+ * \return Root label of the joined region
+ **/
+int mask_labeler_union(mask_labeler_t *labeler, int label_1, int label_2){
+	int root_1 = mask_labeler_find(labeler, label_1);
+	int root_2 = mask_labeler_find(labeler, label_2);
+	if (root_1 == root_2){
+		return root_1;
+	}
+	labeler->parent[root_2] = root_1;
+	mask_region_t *region = &(labeler->regions[root_1]);
+	const mask_region_t *merged = &(labeler->regions[root_2]);
+	region->area += merged->area;
+	region->start_line = min(region->start_line, merged->start_line);
+	region->end_line = max(region->end_line, merged->end_line);
+	region->start_sample = min(region->start_sample, merged->start_sample);
+	region->end_sample = max(region->end_sample, merged->end_sample);
+	return root_1;
+}
+
+void mask_labeler_push_line(mask_labeler_t *labeler, const unsigned char *line){
+	int n = labeler->num_samples;
+	int *prev = labeler->prev_labels;
+	int *curr = labeler->curr_labels;
+	long line_ind = labeler->num_lines;
+
+	for (int j=0; j < n; j++){
+		curr[j] = -1;
+		if (!line[j]){
+			continue;
+		}
+
+		//join with labeled neighbours to the left and in the previous line
+		int neighbours[4] = {(j > 0) ? curr[j-1] : -1, (j > 0) ? prev[j-1] : -1, prev[j], (j < n - 1) ? prev[j+1] : -1};
+		int label = -1;
+		for (int k=0; k < 4; k++){
+			if (neighbours[k] < 0){
+				continue;
+			}
+			if (label < 0){
+				label = mask_labeler_find(labeler, neighbours[k]);
+			} else {
+				label = mask_labeler_union(labeler, label, neighbours[k]);
+			}
+		}
+
+		if (label < 0){
+			label = labeler->parent.size();
+			labeler->parent.push_back(label);
+			mask_region_t region = {0, line_ind, line_ind, j, j};
+			labeler->regions.push_back(region);
+		}
+		curr[j] = label;
+
+		mask_region_t *region = &(labeler->regions[label]);
+		region->area++;
+		region->end_line = line_ind;
+		region->start_sample = min(region->start_sample, j);
+		region->end_sample = max(region->end_sample, j);
+	}
+
+	//compact labels: regions present in this line get consecutive labels, the rest are complete
+	int num_labels = labeler->parent.size();
+	vector<int> new_labels(num_labels, -1);
+	vector<mask_region_t> new_regions;
+	for (int j=0; j < n; j++){
+		if (curr[j] < 0){
+			continue;
+		}
+		int root = mask_labeler_find(labeler, curr[j]);
+		if (new_labels[root] < 0){
+			new_labels[root] = new_regions.size();
+			new_regions.push_back(labeler->regions[root]);
+		}
+		curr[j] = new_labels[root];
+	}
+	for (int i=0; i < num_labels; i++){
+		if ((labeler->parent[i] == i) && (new_labels[i] < 0)){
+			labeler->completed.push_back(labeler->regions[i]);
+		}
+	}
+	labeler->regions = new_regions;
+	labeler->parent.resize(new_regions.size());
+	for (int i=0; i < (int)new_regions.size(); i++){
+		labeler->parent[i] = i;
+	}
+
+	labeler->prev_labels = curr;
+	labeler->curr_labels = prev;
+	labeler->num_lines++;
+}
+
+void mask_labeler_finish(mask_labeler_t *labeler){
+	for (int i=0; i < (int)labeler->parent.size(); i++){
+		if (labeler->parent[i] == i){
+			labeler->completed.push_back(labeler->regions[i]);
+		}
+	}
+	labeler->parent.clear();
+	labeler->regions.clear();
+	for (int j=0; j < labeler->num_samples; j++){
+		labeler->prev_labels[j] = -1;
+	}
+}
+
+bool mask_labeler_pop_region(mask_labeler_t *labeler, mask_region_t *ret_region){
+	if (labeler->completed.empty()){
+		return false;
+	}
+	*ret_region = labeler->completed.front();
+	labeler->completed.pop_front();
+	return true;
+}
+
+void mask_postprocess_init(mask_postprocess_t *postprocess, int num_samples, int opening_radius, int closing_radius){
+	postprocess->num_samples = num_samples;
+	postprocess->filters.clear();
+	postprocess->cleaned.clear();
+
+	morphology_op_t ops[4] = {MORPHOLOGY_ERODE, MORPHOLOGY_DILATE, MORPHOLOGY_DILATE, MORPHOLOGY_ERODE};
+	int radii[4] = {opening_radius, opening_radius, closing_radius, closing_radius};
+	for (int i=0; i < 4; i++){
+		if (radii[i] > 0){
+			morphology_filter_t filter;
+			morphology_init(&filter, ops[i], num_samples, radii[i]);
+			postprocess->filters.push_back(filter);
+		}
+	}
+
+	postprocess->stage_lines = new unsigned char*[postprocess->filters.size()];
+	for (int i=0; i < (int)postprocess->filters.size(); i++){
+		postprocess->stage_lines[i] = new unsigned char[num_samples];
+	}
+	mask_labeler_init(&(postprocess->labeler), num_samples);
+}
+
+void mask_postprocess_free(mask_postprocess_t *postprocess){
+	for (int i=0; i < (int)postprocess->filters.size(); i++){
+		morphology_free(&(postprocess->filters[i]));
+		delete [] postprocess->stage_lines[i];
+	}
+	delete [] postprocess->stage_lines;
+	postprocess->filters.clear();
+	postprocess->cleaned.clear();
+	mask_labeler_free(&(postprocess->labeler));
+}
+
+/**
+ * Push line through the filters starting at the given stage. Lines coming out of the last filter are labeled and queued. 
+ **/
+void mask_postprocess_push_from_stage(mask_postprocess_t *postprocess, int stage, const unsigned char *line){
+	if (stage == (int)postprocess->filters.size()){
+		mask_labeler_push_line(&(postprocess->labeler), line);
+		postprocess->cleaned.push_back(vector<unsigned char>(line, line + postprocess->num_samples));
+	} else if (morphology_push_line(&(postprocess->filters[stage]), line, postprocess->stage_lines[stage])){
+		mask_postprocess_push_from_stage(postprocess, stage + 1, postprocess->stage_lines[stage]);
+	}
+}
+
+void mask_postprocess_push_line(mask_postprocess_t *postprocess, const unsigned char *line){
+	mask_postprocess_push_from_stage(postprocess, 0, line);
+}
+
+void mask_postprocess_finish(mask_postprocess_t *postprocess){
+	for (int i=0; i < (int)postprocess->filters.size(); i++){
+		while (morphology_flush_line(&(postprocess->filters[i]), postprocess->stage_lines[i])){
+			mask_postprocess_push_from_stage(postprocess, i + 1, postprocess->stage_lines[i]);
+		}
+	}
+	mask_labeler_finish(&(postprocess->labeler));
+}
+
+bool mask_postprocess_pop_line(mask_postprocess_t *postprocess, unsigned char *ret_line){
+	if (postprocess->cleaned.empty()){
+		return false;
+	}
+	copy(postprocess->cleaned.front().begin(), postprocess->cleaned.front().end(), ret_line);
+	postprocess->cleaned.pop_front();
+	return true;
+}
+
+bool mask_postprocess_pop_region(mask_postprocess_t *postprocess, mask_region_t *ret_region){
+	return mask_labeler_pop_region(&(postprocess->labeler), ret_region);
+}
@@ -0,0 +1,191 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef POSTPROCESS_H_DEFINED
+#define POSTPROCESS_H_DEFINED
+
+#include <vector>
+#include <deque>
+
+/**
+ * Binary morphological operations. 
+ **/
+enum morphology_op_t{MORPHOLOGY_ERODE, MORPHOLOGY_DILATE};
+
+/**
+ * Line-streaming binary morphological filter with a square structuring element of size (2*radius + 1). Only the last 2*radius + 1 lines are kept in memory. 
+ * Pixels outside the image are ignored. 
+ **/
+typedef struct{
+	/// Operation
+	morphology_op_t op;
+	/// Radius of structuring element
+	int radius;
+	/// Number of samples per line
+	int num_samples;
+	/// Ring buffer over the last 2*radius + 1 horizontally filtered input lines
+	unsigned char **window;
+	/// Number of lines received
+	long num_lines_in;
+	/// Number of lines produced
+	long num_lines_out;
+} morphology_filter_t;
+
+/**
+ * Initialize morphological filter. 
+ * \param filter Output filter
+ * \param op Operation
+ * \param num_samples Number of samples per line
+ * \param radius Radius of structuring element
+ **/
+void morphology_init(morphology_filter_t *filter, morphology_op_t op, int num_samples, int radius);
+
+/**
+ * Add line to the filter. 
+ * \param filter Filter
+ * \param line Input mask line, num_samples values
+ * \param ret_line Output mask line, num_samples values. Lags radius lines behind the input
+ * \return true if a line was written to ret_line
+ **/
+bool morphology_push_line(morphology_filter_t *filter, const unsigned char *line, unsigned char *ret_line);
+
+/**
+ * Get the remaining lines after the last input line has been added. Call until false is returned. 
+ * \param filter Filter
+ * \param ret_line Output mask line
+ * \return true if a line was written to ret_line
+ **/
+bool morphology_flush_line(morphology_filter_t *filter, unsigned char *ret_line);
+
+/**
+ * Free memory associated with morphological filter. 
+ **/
+void morphology_free(morphology_filter_t *filter);
+
+/**
+ * Statistics of a connected region in the mask. 
+ **/
+typedef struct{
+	/// Number of pixels in region
+	long area;
+	/// First line containing the region
+	long start_line;
+	/// Last line containing the region
+	long end_line;
+	/// First sample containing the region
+	int start_sample;
+	/// Last sample containing the region
+	int end_sample;
+} mask_region_t;
+
+/**
+ * Single-pass connected-component labeler over mask lines (8-connectivity), using union-find over provisional labels. 
+ * Labels are compacted after each line and regions are reported as soon as they are complete, so memory is bounded by the line width. 
+ **/
+typedef struct{
+	/// Number of samples per line
+	int num_samples;
+	/// Number of lines received
+	long num_lines;
+	/// Labels of previous line, -1 for background
+	int *prev_labels;
+	/// Labels of current line, -1 for background
+	int *curr_labels;
+	/// Union-find parents of the provisional labels
+	std::vector<int> parent;
+	/// Region statistics of each provisional label, valid for root labels
+	std::vector<mask_region_t> regions;
+	/// Completed regions not yet retrieved
+	std::deque<mask_region_t> completed;
+} mask_labeler_t;
+
+/**
+ * Initialize connected-component labeler. 
+ * \param labeler Output labeler
+ * \param num_samples Number of samples per line
+ **/
+void mask_labeler_init(mask_labeler_t *labeler, int num_samples);
+
+/**
+ * Label next mask line. Regions that do not continue into this line are moved to the completed regions. 
+ **/
+void mask_labeler_push_line(mask_labeler_t *labeler, const unsigned char *line);
+
+/**
+ * Complete all remaining regions after the last line. 
+ **/
+void mask_labeler_finish(mask_labeler_t *labeler);
+
+/**
+ * Retrieve a completed region. 
+ * \param labeler Labeler
+ * \param ret_region Output region statistics
+ * \return true if a region was retrieved
+ **/
+bool mask_labeler_pop_region(mask_labeler_t *labeler, mask_region_t *ret_region);
+
+/**
+ * Free memory associated with labeler. 
+ **/
+void mask_labeler_free(mask_labeler_t *labeler);
+
+/**
+ * Post-processing of the raw masks from masking_pixel_belongs(): morphological opening, then closing, and connected-component labeling of the cleaned mask. 
+ * Mask lines are streamed through the pipeline and come out delayed by 2*(opening_radius + closing_radius) lines. 
+ **/
+typedef struct{
+	/// Number of samples per line
+	int num_samples;
+	/// Morphological filters: erosion and dilation for opening, dilation and erosion for closing. Filters with zero radius are skipped
+	std::vector<morphology_filter_t> filters;
+	/// Temporary line buffers between filters
+	unsigned char **stage_lines;
+	/// Connected-component labeler of cleaned mask
+	mask_labeler_t labeler;
+	/// Cleaned mask lines not yet retrieved
+	std::deque<std::vector<unsigned char> > cleaned;
+} mask_postprocess_t;
+
+/**
+ * Initialize post-processing. 
+ * \param postprocess Output post-processing pipeline
+ * \param num_samples Number of samples per line
+ * \param opening_radius Radius of structuring element for opening, 0 to skip opening
+ * \param closing_radius Radius of structuring element for closing, 0 to skip closing
+ **/
+void mask_postprocess_init(mask_postprocess_t *postprocess, int num_samples, int opening_radius, int closing_radius);
+
+/**
+ * Add raw mask line. 
+ **/
+void mask_postprocess_push_line(mask_postprocess_t *postprocess, const unsigned char *line);
+
+/**
+ * Push the remaining lines through the pipeline after the last raw mask line. 
+ **/
+void mask_postprocess_finish(mask_postprocess_t *postprocess);
+
+/**
+ * Retrieve the next cleaned mask line. 
+ * \param postprocess Post-processing pipeline
+ * \param ret_line Output mask line, num_samples values
+ * \return true if a line was retrieved
+ **/
+bool mask_postprocess_pop_line(mask_postprocess_t *postprocess, unsigned char *ret_line);
+
+/**
+ * Retrieve statistics of the next completed region in the cleaned mask. 
+ * \return true if a region was retrieved
+ **/
+bool mask_postprocess_pop_region(mask_postprocess_t *postprocess, mask_region_t *ret_region);
+
+/**
+ * Free memory associated with post-processing. 
+ **/
+void mask_postprocess_free(mask_postprocess_t *postprocess);
+
+#endif
@@ -0,0 +1,109 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "protocol.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+using namespace std;
+
+bool protocol_send(int socket, const void *data, size_t size, int fd){
+	const char *bytes = (const char*)data;
+	size_t sent = 0;
+	while (sent < size){
+		struct iovec iov;
+		iov.iov_base = (void*)(bytes + sent);
+		iov.iov_len = size - sent;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		//file descriptor goes along with the first byte
+		char control[CMSG_SPACE(sizeof(int))];
+		if ((fd >= 0) && (sent == 0)){
+			memset(control, 0, sizeof(control));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+
+		ssize_t ret = sendmsg(socket, &msg, MSG_NOSIGNAL);
+		if (ret < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		sent += ret;
+	}
+	return true;
+}
+
+bool protocol_recv(int socket, void *data, size_t size, int *fd){
+	if (fd != NULL){
+		*fd = -1;
+	}
+	char *bytes = (char*)data;
+	size_t received = 0;
+	while (received < size){
+		struct iovec iov;
+		iov.iov_base = bytes + received;
+		iov.iov_len = size - received;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		char control[CMSG_SPACE(sizeof(int))];
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t ret = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+		if (ret < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return false;
+		} else if (ret == 0){
+			return false;
+		}
+		received += ret;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+			if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)){
+				int received_fd;
+				memcpy(&received_fd, CMSG_DATA(cmsg), sizeof(int));
+				if ((fd != NULL) && (*fd < 0)){
+					*fd = received_fd;
+				} else {
+					close(received_fd);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+int protocol_create_shared_memory(size_t size){
+	int fd = memfd_create("masking", MFD_CLOEXEC);
+	if (fd < 0){
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,88 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef PROTOCOL_H_DEFINED
+#define PROTOCOL_H_DEFINED
+
+#include <stddef.h>
+
+/**
+ * Messages between masking server and clients over a local Unix domain socket. Each request is answered by one response, 
+ * several requests can be sent over the same connection. Image data and masks are passed as shared memory file descriptors. 
+ **/
+
+#define PROTOCOL_MAX_PATH 4096
+#define PROTOCOL_MAX_MESSAGE 256
+
+/**
+ * Request types. 
+ **/
+enum protocol_request_type_t{
+	/// Mask hyperspectral image file on disk. The file is opened by the server, with the server's permissions
+	PROTOCOL_REQUEST_FILE = 0,
+	/// Mask BIL float data in attached file descriptor, lines*bands*samples values. Followed by bands wavelengths
+	PROTOCOL_REQUEST_DATA = 1
+};
+
+typedef struct{
+	/// Request type, protocol_request_type_t
+	int type;
+	/// Masking type, masking_input_data_type_t
+	int masking_type;
+	/// Image dimensions, for PROTOCOL_REQUEST_DATA
+	int samples;
+	int lines;
+	int bands;
+	/// Hyperspectral image filename, for PROTOCOL_REQUEST_FILE
+	char filename[PROTOCOL_MAX_PATH];
+} protocol_request_t;
+
+/**
+ * Response status. 
+ **/
+enum protocol_status_t{
+	PROTOCOL_OK = 0,
+	PROTOCOL_ERR = -1
+};
+
+typedef struct{
+	/// Status, protocol_status_t. On success, a file descriptor containing lines*samples mask values is attached
+	int status;
+	/// Mask dimensions
+	int samples;
+	int lines;
+	/// Error message
+	char message[PROTOCOL_MAX_MESSAGE];
+} protocol_response_t;
+
+/**
+ * Send data over socket, optionally with a file descriptor. 
+ * \param socket Socket
+ * \param data Data
+ * \param size Size of data in bytes
+ * \param fd File descriptor to pass along, -1 for none
+ * \return true on success
+ **/
+bool protocol_send(int socket, const void *data, size_t size, int fd);
+
+/**
+ * Receive data from socket, optionally with a file descriptor. 
+ * \param socket Socket
+ * \param data Output data
+ * \param size Size of data in bytes
+ * \param fd Output file descriptor, -1 if none was passed. Can be NULL
+ * \return true on success, false on error or closed connection
+ **/
+bool protocol_recv(int socket, void *data, size_t size, int *fd);
+
+/**
+ * Create anonymous shared memory of the specified size. 
+ * \return File descriptor, -1 on failure
+ **/
+int protocol_create_shared_memory(size_t size);
+
+#endif
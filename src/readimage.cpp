@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 using namespace std;
 
 const int MAX_CHAR = 512;
@@ -18,37 +19,57 @@ const int MAX_FILE_SIZE = 4000;
 
 int getMatch(char *string, regmatch_t *matchArray, int matchNum, char **match);
 
-//extract specified property value from header text as a char array
+//extract specified property value from header text as a char array, NULL if not found
 char* getValue(char *hdrText, const char *property);
 
+//positive integer value of header property, 0 if invalid
+int getDimension(const char *value);
+
 //return list of wavelengths. Input: char array containing characters {wlen1, wlen2, wlen3, ...}
 vector<float> getWavelengths(int bands, char* wavelengthStr);
 
 char *getBasename(char *filename);
 
+//image filename without .gz or .zst compression extension
+string stripCompression(const char *filename);
+
+string hyperspectral_header_filename(const char *filename){
+	//header of compressed images is not compressed
+	string imageName = stripCompression(filename);
+	char *baseName = getBasename((char*)imageName.c_str());
+	string hdrName = string(baseName) + ".hdr";
+	free(baseName);
+	return hdrName;
+}
+
 void hyperspectral_read_header(char *filename, HyspexHeader *header){
-	//find base filename
-	char *baseName = getBasename(filename);
+	hyperspectral_err_t errcode = hyperspectral_try_read_header(filename, header);
+	if (errcode != HYPERSPECTRAL_NO_ERR){
+		fprintf(stderr, "%s: %s, exiting\n", hyperspectral_error_message(errcode), hyperspectral_header_filename(filename).c_str());
+		exit(1);
+	}
+}
 
+hyperspectral_err_t hyperspectral_try_read_header(const char *filename, HyspexHeader *header){
 	//open and read header file
-	//append .hdr to filename
-	char *hdrName = (char*)malloc(sizeof(char)*MAX_CHAR);
-	strcpy(hdrName, baseName);
-	strcat(hdrName, ".hdr");
-
-	FILE *fp = fopen(hdrName, "rt");
+	string hdrName = hyperspectral_header_filename(filename);
+	FILE *fp = fopen(hdrName.c_str(), "rt");
 	if (fp == NULL){
-		fprintf(stderr, "Could not find header file: %s, exiting\n", hdrName);
-		exit(1);
+		return HYPERSPECTRAL_HEADER_NOT_FOUND;
 	}
-	char hdrText[MAX_FILE_SIZE] = "";
-	int sizeRead = 1;
-	int offset = 0;
+	//headers with long wavelength lists can be of any size
+	vector<char> hdrBuffer(MAX_FILE_SIZE);
+	size_t sizeRead = 1;
+	size_t offset = 0;
 	while (sizeRead){
-		sizeRead = fread(hdrText + offset, sizeof(char), MAX_CHAR, fp);
+		if (hdrBuffer.size() - offset < MAX_CHAR + 1){
+			hdrBuffer.resize(hdrBuffer.size()*2);
+		}
+		sizeRead = fread(&hdrBuffer[offset], sizeof(char), MAX_CHAR, fp);
 		offset += sizeRead/sizeof(char);
-
 	}
+	hdrBuffer[offset] = '\0';
+	char *hdrText = &hdrBuffer[0];
 	fclose(fp);
 
 	//extract properties from header file text
@@ -60,24 +81,27 @@ void hyperspectral_read_header(char *filename, HyspexHeader *header){
 	char *interleave = getValue(hdrText, "interleave");
 	char *datatype = getValue(hdrText, "data type");
 
-	//convert strings to values
-	header->bands = strtod(bands, NULL);
-	header->lines = strtod(lines, NULL);
-	header->samples = strtod(samples, NULL);
-	header->offset = strtod(hdrOffset, NULL);
-	header->wlens = getWavelengths(header->bands, wavelengths);
-	header->datatype = strtod(datatype, NULL);
-
-
-	if (strcmp(interleave, "bil")){
-		fprintf(stderr, "Interleave not supported by this file reader: %s, exiting\n", interleave);
-		exit(1);
+	hyperspectral_err_t errcode = HYPERSPECTRAL_NO_ERR;
+	if ((samples == NULL) || (bands == NULL) || (lines == NULL) || (wavelengths == NULL) || (hdrOffset == NULL) || (interleave == NULL) || (datatype == NULL)){
+		errcode = HYPERSPECTRAL_HEADER_PROPERTY_MISSING;
+	} else if (strcmp(interleave, "bil")){
+		fprintf(stderr, "Interleave not supported by this file reader: %s\n", interleave);
+		errcode = HYPERSPECTRAL_INTERLEAVE_NOT_SUPPORTED;
+	} else {
+		//convert strings to values
+		header->bands = getDimension(bands);
+		header->lines = getDimension(lines);
+		header->samples = getDimension(samples);
+		header->offset = strtoll(hdrOffset, NULL, 10);
+		header->datatype = strtod(datatype, NULL);
+		if ((header->bands <= 0) || (header->lines <= 0) || (header->samples <= 0) || (header->offset < 0)){
+			errcode = HYPERSPECTRAL_INVALID_DIMENSIONS;
+		} else {
+			header->wlens = getWavelengths(header->bands, wavelengths);
+		}
 	}
 
 	//cleanup
-	free(baseName);
-	free(hdrName);
-
 	free(wavelengths);
 	free(samples);
 	free(bands);
@@ -85,70 +109,47 @@ void hyperspectral_read_header(char *filename, HyspexHeader *header){
 	free(hdrOffset);
 	free(interleave);
 	free(datatype);
+	if (errcode != HYPERSPECTRAL_NO_ERR){
+		return errcode;
+	}
 
 	//recap
-	fprintf(stderr, "Extracted: lines=%d, samples=%d, bands=%d, offset=%d\n", header->lines, header->samples, header->bands, header->offset);
+	fprintf(stderr, "Extracted: lines=%d, samples=%d, bands=%d, offset=%lld\n", header->lines, header->samples, header->bands, (long long)header->offset);
 	fprintf(stderr, "Wavelengths: ");
 	for (int i=0; i < header->wlens.size(); i++){
 		fprintf(stderr, "%f ", header->wlens[i]);
 	}
 	fprintf(stderr, "\n");
+	return HYPERSPECTRAL_NO_ERR;
 }
 
-void hyperspectral_read_image(char *filename, HyspexHeader *header, ImageSubset subset, float *data){
-	//find number of bytes for contained element
-	size_t elementBytes = 0;
-	if (header->datatype == 4){
-		elementBytes = sizeof(float);
-	} else if (header->datatype == 12){
-		elementBytes = sizeof(uint16_t);
-	} else {
-		fprintf(stderr, "Datatype not supported.\n");
-		exit(1);
+const char *hyperspectral_error_message(hyperspectral_err_t errcode){
+	switch (errcode){
+		case HYPERSPECTRAL_NO_ERR:
+			return "No error.";
+		case HYPERSPECTRAL_HEADER_NOT_FOUND:
+			return "Could not find header file";
+		case HYPERSPECTRAL_HEADER_PROPERTY_MISSING:
+			return "Missing property in header file";
+		case HYPERSPECTRAL_INTERLEAVE_NOT_SUPPORTED:
+			return "Interleave not supported by this file reader";
+		case HYPERSPECTRAL_INVALID_DIMENSIONS:
+			return "Invalid image dimensions";
+		case HYPERSPECTRAL_DATATYPE_NOT_SUPPORTED:
+			return "Datatype not supported";
+		case HYPERSPECTRAL_FILE_NOT_FOUND:
+			return "Could not open file";
+		case HYPERSPECTRAL_COMPRESSION_NOT_SUPPORTED:
+			return "Compiled without support for the compression of this file";
+		case HYPERSPECTRAL_READ_ERR:
+			return "Could not read or decompress image data";
 	}
+	return "Unknown error.";
+}
 
-	FILE *fp = fopen(filename, "rb");
-	if (fp == NULL){
-		fprintf(stderr, "Could not open file.\n");
-		exit(1);
-	}
-	
-	//skip header and lines we do not want
-	size_t skipBytes = subset.startLine*header->samples*header->bands*elementBytes + header->offset;
-	fseek(fp, skipBytes, SEEK_SET);
-
-	int numLinesToRead = subset.endLine - subset.startLine;
-
-
-	//read in line by line
-	for (int i=0; i < numLinesToRead; i++){
-		char *line = (char*)malloc(elementBytes*header->bands*header->samples);
-		int sizeRead = fread(line, elementBytes, header->bands*header->samples, fp);
-		if (sizeRead == 0){
-			fprintf(stderr, "Something went extremely wrong in the file reading: %d, %d\n", ferror(fp), feof(fp));
-			exit(1);
-		}
-
-		//convert to float, copy to total array
-		for (int j=subset.startSamp; j < subset.endSamp; j++){
-			for (int k=subset.startBand; k < subset.endBand; k++){
-				float val;
-				int position = k*header->samples + j;
-				if (header->datatype == 4){
-					val = ((float*)line)[position];
-				} else if (header->datatype == 12){
-					val = (((uint16_t*)line)[position])*1.0f;
-				}
-				data[i*(subset.endBand - subset.startBand)*(subset.endSamp - subset.startSamp) + (k - subset.startBand)*(subset.endSamp - subset.startSamp) + j-subset.startSamp] = val;
-			}
-		}
-		free(line);
-
-
-
-	}
-	fclose(fp);
-	
+int getDimension(const char *value){
+	double dimension = strtod(value, NULL);
+	return ((dimension >= 1) && (dimension <= INT_MAX)) ? (int)dimension : 0;
 }
 
 int getMatch(char *string, regmatch_t *matchArray, int matchNum, char **match){
@@ -158,6 +159,7 @@ int getMatch(char *string, regmatch_t *matchArray, int matchNum, char **match){
 	
 	strncpy(*match, string+start, end-start);
 	(*match)[end-start] = '\0';
+	return end-start;
 }
 
 char* getValue(char *hdrText, const char *property){
@@ -173,8 +175,10 @@ char* getValue(char *hdrText, const char *property){
 	int retcode = regcomp(&propertyMatch, regexExpr, REG_EXTENDED | REG_NEWLINE);
 	int match = regexec(&propertyMatch, hdrText, numMatch, matchArray, 0);
 	if (match != 0){
-		fprintf(stderr, "Could not find property in header file: %s\nExiting\n", property);
-		exit(1);
+		fprintf(stderr, "Could not find property in header file: %s\n", property);
+		regfree(&propertyMatch);
+		free(matchArray);
+		return NULL;
 	}
 	char *retVal;
 	getMatch(hdrText, matchArray, 1, &retVal);
@@ -195,7 +199,12 @@ char *getBasename(char *filename){
 	int retcode = regcomp(&filenameMatch, "(.*)[.].*$", REG_EXTENDED);
 	int match = regexec(&filenameMatch, filename, numMatch, matchArray, 0);
 	char *baseName;
-	getMatch(filename, matchArray, 1, &baseName);
+	if (match != 0){
+		//no extension
+		baseName = strdup(filename);
+	} else {
+		getMatch(filename, matchArray, 1, &baseName);
+	}
 	regfree(&filenameMatch);
 	free(matchArray);
 	return baseName;
@@ -212,20 +221,19 @@ vector<float> getWavelengths(int bands, char* wavelengthStr){
 	int retcode = regcomp(&numberMatch, regexExpr, REG_EXTENDED);
 	
 	//find start of number sequence
-	char *currStart = strchr(wavelengthStr, '{') + 1;
+	char *currStart = strchr(wavelengthStr, '{');
 	
 	//go through all bands
-	bool useStandardValues = false;
-	for (int i=0; i < bands; i++){
+	bool useStandardValues = (currStart == NULL);
+	for (int i=0; (i < bands) && !useStandardValues; i++){
 		//extract wavelength
-		if (regexec(&numberMatch, currStart, numMatch, matchArray, 0)){
-			fprintf(stderr, "Could not extract wavelengths. Assuming standard values 1, 2, 3, ... .\n");
+		if (regexec(&numberMatch, currStart + 1, numMatch, matchArray, 0)){
 			useStandardValues = true;
 			break;
 		}
 		
 		char *match;
-		getMatch(currStart, matchArray, 1, &match);
+		getMatch(currStart + 1, matchArray, 1, &match);
 		retWlens.push_back(strtod(match, NULL));
 		free(match);
 
@@ -234,6 +242,7 @@ vector<float> getWavelengths(int bands, char* wavelengthStr){
 	}
 
 	if (useStandardValues){
+		fprintf(stderr, "Could not extract wavelengths. Assuming standard values 1, 2, 3, ... .\n");
 		retWlens.clear();
 		for (int i=0; i < bands; i++){
 			retWlens.push_back(i);
@@ -253,9 +262,10 @@ vector<float> getWavelengths(int bands, char* wavelengthStr){
 #include <math.h>
 #include <cstring>
 #include <sstream>
+#include <errno.h>
 using namespace std;
 
-void hyperspectral_write_header(const char *filename, int numBands, int numPixels, int numLines, std::vector<float> wlens){
+void hyperspectral_write_header(const char *filename, int numBands, int numPixels, int numLines, std::vector<float> wlens, int datatype, const char *interleave){
 	//write image header
 	ostringstream hdrFname;
 	hdrFname << filename << ".hdr";
@@ -266,8 +276,8 @@ void hyperspectral_write_header(const char *filename, int numBands, int numPixel
 	hdrOut << "bands = " << numBands << endl;
 	hdrOut << "header offset = 0" << endl;
 	hdrOut << "file type = ENVI Standard" << endl;
-	hdrOut << "data type = 4" << endl;
-	hdrOut << "interleave = bil" << endl;
+	hdrOut << "data type = " << datatype << endl;
+	hdrOut << "interleave = " << interleave << endl;
 	hdrOut << "default bands = {55,41,12}" << endl;
 	hdrOut << "byte order = 0" << endl;
 	hdrOut << "wavelength = {";
@@ -279,19 +289,734 @@ void hyperspectral_write_header(const char *filename, int numBands, int numPixel
 }
 
 void hyperspectral_write_image(const char *filename, int numBands, int numPixels, int numLines, float *data){
-	//prepare image file
+	HyspexWriter writer;
+	hyperspectral_writer_open(&writer, filename, numBands, numPixels, numLines, std::vector<float>(), 4, "bil", false);
+	hyperspectral_writer_write_lines(&writer, numLines, data);
+	hyperspectral_writer_close(&writer);
+}
+
+#include <fcntl.h>
+#include <unistd.h>
+
+const size_t WRITER_BUFFER_SIZE = 4*1024*1024;
+const size_t WRITER_BUFFER_ALIGNMENT = 4096;
+
+//number of bytes per element of supported ENVI datatypes, 0 if not supported
+size_t getElementBytes(int datatype){
+	switch (datatype){
+		case 1:
+			return sizeof(uint8_t);
+		case 2:
+			return sizeof(int16_t);
+		case 4:
+			return sizeof(float);
+		case 5:
+			return sizeof(double);
+		case 12:
+			return sizeof(uint16_t);
+	}
+	return 0;
+}
+
+//element of specified ENVI datatype as double
+double getElement(const void *data, size_t position, int datatype){
+	switch (datatype){
+		case 1:
+			return ((const uint8_t*)data)[position];
+		case 2:
+			return ((const int16_t*)data)[position];
+		case 4:
+			return ((const float*)data)[position];
+		case 5:
+			return ((const double*)data)[position];
+		case 12:
+			return ((const uint16_t*)data)[position];
+	}
+	return 0;
+}
+
+//set element of specified ENVI datatype, integer types are rounded and clamped
+void setElement(void *data, size_t position, int datatype, double value){
+	switch (datatype){
+		case 1:
+			((uint8_t*)data)[position] = (value != value) ? 0 : fmin(fmax(round(value), 0), UINT8_MAX);
+		break;
+		case 2:
+			((int16_t*)data)[position] = (value != value) ? 0 : fmin(fmax(round(value), INT16_MIN), INT16_MAX);
+		break;
+		case 4:
+			((float*)data)[position] = value;
+		break;
+		case 5:
+			((double*)data)[position] = value;
+		break;
+		case 12:
+			((uint16_t*)data)[position] = (value != value) ? 0 : fmin(fmax(round(value), 0), UINT16_MAX);
+		break;
+	}
+}
+
+void flushWriter(HyspexWriter *writer){
+	size_t written = 0;
+	while (written < writer->bufferUsed){
+		ssize_t ret = write(writer->fd, writer->buffer + written, writer->bufferUsed - written);
+		if (ret < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			fprintf(stderr, "Could not write image data: %s\n", strerror(errno));
+			exit(1);
+		}
+		written += ret;
+	}
+	writer->bufferUsed = 0;
+}
+
+void hyperspectral_writer_open(HyspexWriter *writer, const char *filename, int bands, int samples, int lines, std::vector<float> wlens, int datatype, const char *interleave, bool writeHeader){
+	writer->elementBytes = getElementBytes(datatype);
+	if (writer->elementBytes == 0){
+		fprintf(stderr, "Datatype not supported.\n");
+		exit(1);
+	}
+	if (strcmp(interleave, "bil") && strcmp(interleave, "bip")){
+		fprintf(stderr, "Interleave not supported by this file writer: %s, exiting\n", interleave);
+		exit(1);
+	}
+
+	writer->filename = filename;
+	writer->bands = bands;
+	writer->samples = samples;
+	writer->lines = (lines < 0) ? 0 : lines;
+	writer->linesWritten = 0;
+	writer->datatype = datatype;
+	writer->interleave = interleave;
+	writer->wlens = wlens;
+	writer->writeHeader = writeHeader;
+
+	//header is written now and rewritten at close if the number of lines has changed
+	if (writeHeader){
+		hyperspectral_write_header(filename, bands, samples, writer->lines, wlens, datatype, interleave);
+	}
+
 	ostringstream imgFname;
 	imgFname << filename << ".img";
-	ofstream *hyspexOut = new ofstream(imgFname.str().c_str(),ios::out | ios::binary);
-	
-	//write image
+	writer->fd = open(imgFname.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (writer->fd < 0){
+		fprintf(stderr, "Could not open output file: %s\n", imgFname.str().c_str());
+		exit(1);
+	}
+
+	//buffer of whole lines, at least one line
+	size_t lineBytes = writer->elementBytes*bands*samples;
+	size_t bufferLines = (WRITER_BUFFER_SIZE > lineBytes) ? WRITER_BUFFER_SIZE/lineBytes : 1;
+	writer->bufferSize = bufferLines*lineBytes;
+	writer->bufferUsed = 0;
+	void *buffer;
+	if (posix_memalign(&buffer, WRITER_BUFFER_ALIGNMENT, writer->bufferSize) != 0){
+		fprintf(stderr, "Could not allocate output buffer.\n");
+		exit(1);
+	}
+	writer->buffer = (char*)buffer;
+}
+
+void hyperspectral_writer_write_lines(HyspexWriter *writer, int numLines, const void *data, int inputDatatype){
+	size_t inputBytes = getElementBytes(inputDatatype);
+	if (inputBytes == 0){
+		fprintf(stderr, "Datatype not supported.\n");
+		exit(1);
+	}
+	size_t lineElements = (size_t)writer->bands*writer->samples;
+	size_t lineBytes = writer->elementBytes*lineElements;
+	bool bip = !strcmp(writer->interleave.c_str(), "bip");
+
+	for (int i=0; i < numLines; i++){
+		if (writer->bufferUsed + lineBytes > writer->bufferSize){
+			flushWriter(writer);
+		}
+		const char *inputLine = (const char*)data + i*lineElements*inputBytes;
+		char *outputLine = writer->buffer + writer->bufferUsed;
+
+		if (!bip && (inputDatatype == writer->datatype)){
+			memcpy(outputLine, inputLine, lineBytes);
+		} else {
+			//input is BIL: band k of sample j at k*samples + j
+			for (int k=0; k < writer->bands; k++){
+				for (int j=0; j < writer->samples; j++){
+					size_t inputPosition = (size_t)k*writer->samples + j;
+					size_t outputPosition = bip ? (size_t)j*writer->bands + k : inputPosition;
+					setElement(outputLine, outputPosition, writer->datatype, getElement(inputLine, inputPosition, inputDatatype));
+				}
+			}
+		}
+		writer->bufferUsed += lineBytes;
+		writer->linesWritten++;
+	}
+}
+
+void hyperspectral_writer_close(HyspexWriter *writer){
+	flushWriter(writer);
+	close(writer->fd);
+	free(writer->buffer);
+	if (writer->writeHeader && (writer->linesWritten != writer->lines)){
+		hyperspectral_write_header(writer->filename.c_str(), writer->bands, writer->samples, writer->linesWritten, writer->wlens, writer->datatype, writer->interleave.c_str());
+	}
+}
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+const int READER_NUM_BUFFERS = 4;
+const size_t READER_BUFFER_SIZE = 4*1024*1024;
+
+enum ReaderCompression{
+	READER_RAW,
+	READER_GZIP,
+	READER_ZSTD
+};
+
+//compression of image file according to file extension
+ReaderCompression getCompression(const char *filename){
+	size_t length = strlen(filename);
+	if ((length > 3) && !strcmp(filename + length - 3, ".gz")){
+		return READER_GZIP;
+	}
+	if ((length > 4) && !strcmp(filename + length - 4, ".zst")){
+		return READER_ZSTD;
+	}
+	return READER_RAW;
+}
+
+string stripCompression(const char *filename){
+	string strippedName = filename;
+	switch (getCompression(filename)){
+		case READER_GZIP:
+			strippedName.erase(strippedName.size() - 3);
+		break;
+		case READER_ZSTD:
+			strippedName.erase(strippedName.size() - 4);
+		break;
+		case READER_RAW:
+		break;
+	}
+	return strippedName;
+}
+
+#ifdef HAVE_ZSTD
+const uint32_t ZSTD_SKIPPABLE_SEEK_TABLE_MAGIC = 0x184D2A5E;
+const uint32_t ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;
+const size_t ZSTD_SEEKABLE_FOOTER_SIZE = 9;
+
+uint32_t readLittleEndian32(const unsigned char *bytes){
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+//read seek table of a zstd file in the seekable format (independent frames followed by a skippable frame listing their sizes). Fills the 
+//compressed and decompressed start offsets of each frame, return false if the file has no seek table
+bool readZstdSeekTable(int fd, vector<off_t> *compressedOffsets, vector<off_t> *decompressedOffsets){
+	struct stat fileStat;
+	if ((fstat(fd, &fileStat) < 0) || (fileStat.st_size < (off_t)(ZSTD_SEEKABLE_FOOTER_SIZE + 8))){
+		return false;
+	}
+	unsigned char footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+	if (pread(fd, footer, ZSTD_SEEKABLE_FOOTER_SIZE, fileStat.st_size - ZSTD_SEEKABLE_FOOTER_SIZE) != (ssize_t)ZSTD_SEEKABLE_FOOTER_SIZE){
+		return false;
+	}
+	if (readLittleEndian32(footer + 5) != ZSTD_SEEKABLE_MAGIC){
+		return false;
+	}
+	uint32_t numFrames = readLittleEndian32(footer);
+	size_t entryBytes = (footer[4] & 0x80) ? 12 : 8;
+	off_t tableBytes = (off_t)numFrames*entryBytes;
+	off_t frameStart = fileStat.st_size - ZSTD_SEEKABLE_FOOTER_SIZE - tableBytes - 8;
+	if (frameStart < 0){
+		return false;
+	}
+	vector<unsigned char> table(8 + tableBytes);
+	if (pread(fd, &table[0], table.size(), frameStart) != (ssize_t)table.size()){
+		return false;
+	}
+	if ((readLittleEndian32(&table[0]) != ZSTD_SKIPPABLE_SEEK_TABLE_MAGIC) || (readLittleEndian32(&table[4]) != tableBytes + ZSTD_SEEKABLE_FOOTER_SIZE)){
+		return false;
+	}
+
+	compressedOffsets->assign(1, 0);
+	decompressedOffsets->assign(1, 0);
+	for (uint32_t i=0; i < numFrames; i++){
+		const unsigned char *entry = &table[8 + i*entryBytes];
+		compressedOffsets->push_back(compressedOffsets->back() + readLittleEndian32(entry));
+		decompressedOffsets->push_back(decompressedOffsets->back() + readLittleEndian32(entry + 4));
+	}
+	return true;
+}
+#endif
+
+bool hyperspectral_reader_can_seek(const char *filename){
+	switch (getCompression(filename)){
+		case READER_RAW:
+			return true;
+#ifdef HAVE_ZSTD
+		case READER_ZSTD: {
+			int fd = open(filename, O_RDONLY);
+			if (fd < 0){
+				return false;
+			}
+			vector<off_t> compressedOffsets, decompressedOffsets;
+			bool seekable = readZstdSeekTable(fd, &compressedOffsets, &decompressedOffsets);
+			close(fd);
+			return seekable;
+		}
+#endif
+		default:
+			return false;
+	}
+}
+
+//image data decompressed by a background thread into a ring of fixed-size buffers
+struct HyspexReaderStream{
+	ReaderCompression compression;
+	int fd;
+#ifdef HAVE_ZLIB
+	gzFile gz;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *zstd;
+	char *zstdInput;
+	ZSTD_inBuffer zstdInBuffer;
+#endif
+	//number of decompressed bytes to discard before the first buffer is filled
+	off_t skipBytes;
+	//file position of next raw read
+	off_t position;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	char *buffers[READER_NUM_BUFFERS];
+	size_t bufferFilled[READER_NUM_BUFFERS];
+	int numFilled;
+	int readBuffer;
+	size_t readOffset;
+	bool endOfFile;
+	bool failed;
+	bool stopped;
+};
+
+//read up to size decompressed bytes, return number of bytes read, 0 at end of file and -1 on error
+ssize_t readSource(HyspexReaderStream *stream, char *data, size_t size){
+	switch (stream->compression){
+		case READER_RAW:
+			while (true){
+				ssize_t ret = pread(stream->fd, data, size, stream->position);
+				if ((ret < 0) && (errno == EINTR)){
+					continue;
+				}
+				if (ret > 0){
+					stream->position += ret;
+				}
+				return ret;
+			}
+#ifdef HAVE_ZLIB
+		case READER_GZIP:
+			return gzread(stream->gz, data, size);
+#endif
+#ifdef HAVE_ZSTD
+		case READER_ZSTD: {
+			ZSTD_outBuffer outBuffer = {data, size, 0};
+			while (outBuffer.pos == 0){
+				if (stream->zstdInBuffer.pos == stream->zstdInBuffer.size){
+					ssize_t ret = read(stream->fd, stream->zstdInput, ZSTD_DStreamInSize());
+					if ((ret < 0) && (errno == EINTR)){
+						continue;
+					}
+					if (ret <= 0){
+						return ret;
+					}
+					stream->zstdInBuffer.size = ret;
+					stream->zstdInBuffer.pos = 0;
+				}
+				if (ZSTD_isError(ZSTD_decompressStream(stream->zstd, &outBuffer, &(stream->zstdInBuffer)))){
+					return -1;
+				}
+			}
+			return outBuffer.pos;
+		}
+#endif
+		default:
+			return -1;
+	}
+}
+
+//fill buffer completely unless end of file is reached, return number of bytes read or -1 on error
+ssize_t fillBuffer(HyspexReaderStream *stream, char *data, size_t size){
+	size_t filled = 0;
+	while (filled < size){
+		ssize_t ret = readSource(stream, data + filled, size - filled);
+		if (ret < 0){
+			return -1;
+		}
+		if (ret == 0){
+			break;
+		}
+		filled += ret;
+	}
+	return filled;
+}
+
+//background thread: decompress into free buffers until end of file or until stopped
+void runReaderStream(HyspexReaderStream *stream){
+	int writeBuffer = 0;
+	bool failed = false;
+
+	//skip header and lines before start line
+	while ((stream->skipBytes > 0) && !failed){
+		ssize_t ret = fillBuffer(stream, stream->buffers[0], min(stream->skipBytes, (off_t)READER_BUFFER_SIZE));
+		failed = (ret <= 0);
+		stream->skipBytes -= failed ? 0 : ret;
+	}
+
+	while (!failed){
+		{
+			unique_lock<mutex> lock(stream->mutex);
+			stream->changed.wait(lock, [stream]{return stream->stopped || (stream->numFilled < READER_NUM_BUFFERS);});
+			if (stream->stopped){
+				return;
+			}
+		}
+
+		//the consumer does not touch buffers that are not filled
+		ssize_t ret = fillBuffer(stream, stream->buffers[writeBuffer], READER_BUFFER_SIZE);
+		if (ret <= 0){
+			failed = (ret < 0);
+			break;
+		}
+
+		lock_guard<mutex> lock(stream->mutex);
+		stream->bufferFilled[writeBuffer] = ret;
+		stream->numFilled++;
+		writeBuffer = (writeBuffer + 1) % READER_NUM_BUFFERS;
+		stream->changed.notify_all();
+	}
+
+	lock_guard<mutex> lock(stream->mutex);
+	stream->endOfFile = true;
+	stream->failed = failed;
+	stream->changed.notify_all();
+}
+
+//copy up to size bytes from the decompressed stream, return number of bytes copied or -1 on read or decompression errors
+ssize_t readStream(HyspexReaderStream *stream, char *data, size_t size){
+	size_t copied = 0;
+	while (copied < size){
+		size_t available;
+		{
+			unique_lock<mutex> lock(stream->mutex);
+			stream->changed.wait(lock, [stream]{return stream->endOfFile || (stream->numFilled > 0);});
+			if (stream->numFilled == 0){
+				if (stream->failed){
+					return -1;
+				}
+				break;
+			}
+			available = stream->bufferFilled[stream->readBuffer] - stream->readOffset;
+		}
+
+		size_t copySize = min(available, size - copied);
+		memcpy(data + copied, stream->buffers[stream->readBuffer] + stream->readOffset, copySize);
+		copied += copySize;
+		stream->readOffset += copySize;
+
+		//hand buffer back to the decompression thread
+		if (stream->readOffset == stream->bufferFilled[stream->readBuffer]){
+			lock_guard<mutex> lock(stream->mutex);
+			stream->readOffset = 0;
+			stream->readBuffer = (stream->readBuffer + 1) % READER_NUM_BUFFERS;
+			stream->numFilled--;
+			stream->changed.notify_all();
+		}
+	}
+	return copied;
+}
+
+void hyperspectral_reader_open(HyspexReader *reader, const char *filename, const HyspexHeader *header, int startLine){
+	hyperspectral_err_t errcode = hyperspectral_try_reader_open(reader, filename, header, startLine);
+	if (errcode != HYPERSPECTRAL_NO_ERR){
+		fprintf(stderr, "%s: %s, exiting\n", hyperspectral_error_message(errcode), filename);
+		exit(1);
+	}
+}
+
+hyperspectral_err_t hyperspectral_try_reader_open(HyspexReader *reader, const char *filename, const HyspexHeader *header, int startLine){
+	reader->header = *header;
+	reader->linesRead = 0;
+	reader->peekedLines.clear();
+	reader->numPeekedLines = 0;
+	reader->elementBytes = getElementBytes(header->datatype);
+	if (reader->elementBytes == 0){
+		return HYPERSPECTRAL_DATATYPE_NOT_SUPPORTED;
+	}
+	if ((header->bands <= 0) || (header->samples <= 0) || (header->offset < 0) || (startLine < 0)){
+		return HYPERSPECTRAL_INVALID_DIMENSIONS;
+	}
+	ReaderCompression compression = getCompression(filename);
+#ifndef HAVE_ZLIB
+	if (compression == READER_GZIP){
+		return HYPERSPECTRAL_COMPRESSION_NOT_SUPPORTED;
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if (compression == READER_ZSTD){
+		return HYPERSPECTRAL_COMPRESSION_NOT_SUPPORTED;
+	}
+#endif
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0){
+		return HYPERSPECTRAL_FILE_NOT_FOUND;
+	}
+	size_t lineBytes = reader->elementBytes*header->bands*header->samples;
+	reader->line = (char*)malloc(lineBytes);
+
+	HyspexReaderStream *stream = new HyspexReaderStream;
+	stream->compression = compression;
+	stream->fd = fd;
+	off_t skipBytes = (off_t)startLine*lineBytes + header->offset;
+	stream->skipBytes = 0;
+	stream->position = 0;
+	switch (stream->compression){
+		case READER_RAW:
+			//skip header and lines we do not want
+			stream->position = skipBytes;
+		break;
+		case READER_GZIP:
+#ifdef HAVE_ZLIB
+			stream->gz = gzdopen(stream->fd, "rb");
+			if (stream->gz == NULL){
+				close(stream->fd);
+				delete stream;
+				free(reader->line);
+				return HYPERSPECTRAL_READ_ERR;
+			}
+			gzbuffer(stream->gz, READER_BUFFER_SIZE);
+			stream->skipBytes = skipBytes;
+#endif
+		break;
+		case READER_ZSTD:
+#ifdef HAVE_ZSTD
+			stream->zstd = ZSTD_createDCtx();
+			stream->zstdInput = (char*)malloc(ZSTD_DStreamInSize());
+			stream->zstdInBuffer.src = stream->zstdInput;
+			stream->zstdInBuffer.size = 0;
+			stream->zstdInBuffer.pos = 0;
+			stream->skipBytes = skipBytes;
+
+			//seekable format: start decompressing at the frame containing the first wanted byte
+			if (skipBytes > 0){
+				vector<off_t> compressedOffsets, decompressedOffsets;
+				if (readZstdSeekTable(fd, &compressedOffsets, &decompressedOffsets)){
+					size_t frame = upper_bound(decompressedOffsets.begin(), decompressedOffsets.end(), skipBytes) - decompressedOffsets.begin() - 1;
+					frame = min(frame, compressedOffsets.size() - 1);
+					if (lseek(fd, compressedOffsets[frame], SEEK_SET) >= 0){
+						stream->skipBytes = skipBytes - decompressedOffsets[frame];
+					}
+				}
+			}
+#endif
+		break;
+	}
+
+	for (int i=0; i < READER_NUM_BUFFERS; i++){
+		stream->buffers[i] = (char*)malloc(READER_BUFFER_SIZE);
+		stream->bufferFilled[i] = 0;
+	}
+	stream->numFilled = 0;
+	stream->readBuffer = 0;
+	stream->readOffset = 0;
+	stream->endOfFile = false;
+	stream->failed = false;
+	stream->stopped = false;
+	stream->thread = std::thread(runReaderStream, stream);
+	reader->stream = stream;
+	return HYPERSPECTRAL_NO_ERR;
+}
+
+//read lines from the decompressed stream, return number of lines read or -1 on errors
+int readStreamLines(HyspexReader *reader, int numLines, float *data){
+	size_t lineElements = (size_t)reader->header.bands*reader->header.samples;
+	size_t lineBytes = reader->elementBytes*lineElements;
 	for (int i=0; i < numLines; i++){
-		float *write_data = data + i*numBands*numPixels;
-		hyspexOut->write((char*)(write_data), sizeof(float)*numBands*numPixels);
+		ssize_t ret = readStream(reader->stream, reader->line, lineBytes);
+		if (ret < 0){
+			return -1;
+		}
+		if ((size_t)ret < lineBytes){
+			return i;
+		}
+
+		//convert to float
+		float *outputLine = data + i*lineElements;
+		if (reader->header.datatype == 4){
+			memcpy(outputLine, reader->line, lineBytes);
+		} else {
+			for (size_t j=0; j < lineElements; j++){
+				outputLine[j] = getElement(reader->line, j, reader->header.datatype);
+			}
+		}
 	}
+	return numLines;
+}
+
+int hyperspectral_reader_read_lines(HyspexReader *reader, int numLines, float *data){
+	size_t lineElements = (size_t)reader->header.bands*reader->header.samples;
+
+	//lines that have been peeked at come first
+	int numPeeked = min(numLines, reader->numPeekedLines);
+	if (numPeeked > 0){
+		memcpy(data, &(reader->peekedLines[0]), sizeof(float)*numPeeked*lineElements);
+		reader->peekedLines.erase(reader->peekedLines.begin(), reader->peekedLines.begin() + numPeeked*lineElements);
+		reader->numPeekedLines -= numPeeked;
+	}
+
+	int numRead = readStreamLines(reader, numLines - numPeeked, data + numPeeked*lineElements);
+	if (numRead < 0){
+		return -1;
+	}
+	reader->linesRead += numPeeked + numRead;
+	return numPeeked + numRead;
+}
 
-	hyspexOut->close();
-	delete hyspexOut;
+int hyperspectral_reader_peek_lines(HyspexReader *reader, int numLines, float *data){
+	size_t lineElements = (size_t)reader->header.bands*reader->header.samples;
+	if (reader->numPeekedLines < numLines){
+		reader->peekedLines.resize(numLines*lineElements);
+		int numRead = readStreamLines(reader, numLines - reader->numPeekedLines, &(reader->peekedLines[reader->numPeekedLines*lineElements]));
+		if (numRead < 0){
+			return -1;
+		}
+		reader->numPeekedLines += numRead;
+		reader->peekedLines.resize(reader->numPeekedLines*lineElements);
+	}
+	int numPeeked = min(numLines, reader->numPeekedLines);
+	if (numPeeked > 0){
+		memcpy(data, &(reader->peekedLines[0]), sizeof(float)*numPeeked*lineElements);
+	}
+	return numPeeked;
 }
 
+void hyperspectral_reader_close(HyspexReader *reader){
+	HyspexReaderStream *stream = reader->stream;
+	{
+		lock_guard<mutex> lock(stream->mutex);
+		stream->stopped = true;
+		stream->changed.notify_all();
+	}
+	stream->thread.join();
 
+#ifdef HAVE_ZLIB
+	if (stream->compression == READER_GZIP){
+		//closes file descriptor
+		gzclose(stream->gz);
+		stream->fd = -1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (stream->compression == READER_ZSTD){
+		ZSTD_freeDCtx(stream->zstd);
+		free(stream->zstdInput);
+	}
+#endif
+	if (stream->fd >= 0){
+		close(stream->fd);
+	}
+	for (int i=0; i < READER_NUM_BUFFERS; i++){
+		free(stream->buffers[i]);
+	}
+	delete stream;
+	free(reader->line);
+	reader->peekedLines.clear();
+	reader->numPeekedLines = 0;
+}
+
+//read subset of raw image with one pread per line, without the buffers and background thread of the sequential reader
+void readRawSubset(const char *filename, HyspexHeader *header, ImageSubset subset, float *data){
+	size_t elementBytes = getElementBytes(header->datatype);
+	if (elementBytes == 0){
+		fprintf(stderr, "Datatype not supported.\n");
+		exit(1);
+	}
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0){
+		fprintf(stderr, "Could not open file.\n");
+		exit(1);
+	}
+	size_t subsetSamples = subset.endSamp - subset.startSamp;
+	size_t subsetBands = subset.endBand - subset.startBand;
+	size_t bandBytes = elementBytes*header->samples;
+
+	//bands of the subset are contiguous within each line
+	vector<char> line(bandBytes*subsetBands);
+	int numLinesToRead = subset.endLine - subset.startLine;
+	for (int i=0; i < numLinesToRead; i++){
+		off_t position = header->offset + ((off_t)(subset.startLine + i)*header->bands + subset.startBand)*bandBytes;
+		size_t lineRead = 0;
+		while (lineRead < line.size()){
+			ssize_t ret = pread(fd, &line[lineRead], line.size() - lineRead, position + lineRead);
+			if ((ret < 0) && (errno == EINTR)){
+				continue;
+			}
+			if (ret <= 0){
+				fprintf(stderr, "Something went extremely wrong in the file reading: line %d\n", subset.startLine + i);
+				exit(1);
+			}
+			lineRead += ret;
+		}
+
+		//copy subset to total array
+		for (size_t k=0; k < subsetBands; k++){
+			for (size_t j=0; j < subsetSamples; j++){
+				data[(i*subsetBands + k)*subsetSamples + j] = getElement(&line[0], k*header->samples + subset.startSamp + j, header->datatype);
+			}
+		}
+	}
+	close(fd);
+}
+
+void hyperspectral_read_image(char *filename, HyspexHeader *header, ImageSubset subset, float *data){
+	//the sequential reader only pays off for decompression
+	if (getCompression(filename) == READER_RAW){
+		readRawSubset(filename, header, subset, data);
+		return;
+	}
+
+	HyspexReader reader;
+	hyperspectral_reader_open(&reader, filename, header, subset.startLine);
+	size_t lineElements = (size_t)header->bands*header->samples;
+	float *line = new float[lineElements];
+	size_t subsetSamples = subset.endSamp - subset.startSamp;
+	size_t subsetLineElements = (size_t)(subset.endBand - subset.startBand)*subsetSamples;
+
+	//read in line by line
+	int numLinesToRead = subset.endLine - subset.startLine;
+	for (int i=0; i < numLinesToRead; i++){
+		if (hyperspectral_reader_read_lines(&reader, 1, line) < 1){
+			fprintf(stderr, "Something went extremely wrong in the file reading: line %d\n", subset.startLine + i);
+			exit(1);
+		}
+
+		//copy subset to total array
+		for (int j=subset.startSamp; j < subset.endSamp; j++){
+			for (int k=subset.startBand; k < subset.endBand; k++){
+				data[i*subsetLineElements + (k - subset.startBand)*subsetSamples + j-subset.startSamp] = line[(size_t)k*header->samples + j];
+			}
+		}
+	}
+	delete [] line;
+	hyperspectral_reader_close(&reader);
+}
@@ -8,12 +8,16 @@
 #ifndef READIMAGE_H_DEFINED
 #define READIMAGE_H_DEFINED
 #include <vector>
+#include <string>
+#include <sys/types.h>
 
+//image dimensions are limited to 2^31 - 1 each (larger header values are rejected), matching the int sample counts of the masking API 
+//and ImageSubset. Byte offsets and products of dimensions are calculated in off_t or size_t, so images larger than 2^31 bytes or pixels are supported
 typedef struct {
 	int samples;
 	int bands;
 	int lines;
-	int offset;
+	off_t offset;
 	std::vector<float> wlens;
 	int datatype;
 } HyspexHeader;
@@ -26,13 +30,96 @@ typedef struct {
 	int startBand;
 	int endBand;
 } ImageSubset;
-	
+
+//error values of the image reader
+enum hyperspectral_err_t{
+	HYPERSPECTRAL_NO_ERR = 0,
+	HYPERSPECTRAL_HEADER_NOT_FOUND = -1,
+	HYPERSPECTRAL_HEADER_PROPERTY_MISSING = -2,
+	HYPERSPECTRAL_INTERLEAVE_NOT_SUPPORTED = -3,
+	HYPERSPECTRAL_INVALID_DIMENSIONS = -4,
+	HYPERSPECTRAL_DATATYPE_NOT_SUPPORTED = -5,
+	HYPERSPECTRAL_FILE_NOT_FOUND = -6,
+	HYPERSPECTRAL_COMPRESSION_NOT_SUPPORTED = -7,
+	HYPERSPECTRAL_READ_ERR = -8
+};
+
+//error message of image reader error value
+const char *hyperspectral_error_message(hyperspectral_err_t errcode);
+
+//read header, exits on errors
 void hyperspectral_read_header(char *filename, HyspexHeader *header);
+
+//read header, return error value instead of exiting. For callers that must survive malformed files
+hyperspectral_err_t hyperspectral_try_read_header(const char *filename, HyspexHeader *header);
+
+//header filename of image filename, image filename without any .gz or .zst compression extension and with .hdr in place of the last extension
+std::string hyperspectral_header_filename(const char *filename);
+
 void hyperspectral_read_image(char *filename, HyspexHeader *header, ImageSubset subset, float *data);
 
 
-void hyperspectral_write_header(const char *filename, int bands, int samples, int lines, std::vector<float> wlens);
+void hyperspectral_write_header(const char *filename, int bands, int samples, int lines, std::vector<float> wlens, int datatype = 4, const char *interleave = "bil");
 void hyperspectral_write_image(const char *filename, int bands, int samples, int lines, float *data);
 
+//incremental ENVI image writer. Lines are buffered in a fixed-size aligned buffer and written in large blocks, so memory use does not depend on image size
+typedef struct {
+	std::string filename;
+	int samples;
+	int bands;
+	int lines;
+	int linesWritten;
+	int datatype;
+	std::string interleave;
+	std::vector<float> wlens;
+	bool writeHeader;
+	size_t elementBytes;
+	int fd;
+	char *buffer;
+	size_t bufferSize;
+	size_t bufferUsed;
+} HyspexWriter;
+
+//open filename.img for writing, write filename.hdr. lines can be -1 if unknown, the header is rewritten at close if the number of written lines differs. interleave is "bil" or "bip"
+void hyperspectral_writer_open(HyspexWriter *writer, const char *filename, int bands, int samples, int lines, std::vector<float> wlens, int datatype = 4, const char *interleave = "bil", bool writeHeader = true);
+
+//append lines, input data is BIL with elements of ENVI datatype inputDatatype. Converted to output datatype and interleave
+void hyperspectral_writer_write_lines(HyspexWriter *writer, int numLines, const void *data, int inputDatatype = 4);
+
+//flush remaining lines, close file and update header
+void hyperspectral_writer_close(HyspexWriter *writer);
+
+struct HyspexReaderStream;
+
+//sequential image reader. Raw, gzip (.gz) and zstd (.zst) compressed images are read and decompressed by a background thread into a fixed number of buffers, so memory use does not depend on image size
+typedef struct {
+	HyspexHeader header;
+	int linesRead;
+	size_t elementBytes;
+	char *line;
+	HyspexReaderStream *stream;
+	//lines read ahead by hyperspectral_reader_peek_lines(), returned first by the next read
+	std::vector<float> peekedLines;
+	int numPeekedLines;
+} HyspexReader;
+
+//whether lines can be reached without decompressing the preceding image data: true for raw images and zstd images in the seekable format
+bool hyperspectral_reader_can_seek(const char *filename);
+
+//open image for reading lines from startLine. Raw images and seekable zstd images seek directly to startLine (zstd to the start of the 
+//containing frame), other compressed images are decompressed from the start. Exits on errors
+void hyperspectral_reader_open(HyspexReader *reader, const char *filename, const HyspexHeader *header, int startLine = 0);
+
+//open image for reading, return error value instead of exiting. The reader is only opened on success
+hyperspectral_err_t hyperspectral_try_reader_open(HyspexReader *reader, const char *filename, const HyspexHeader *header, int startLine = 0);
+
+//read the next lines as BIL floats, return number of lines read, less than numLines at end of file, -1 on read or decompression errors
+int hyperspectral_reader_read_lines(HyspexReader *reader, int numLines, float *data);
+
+//read the next lines as BIL floats without consuming them, so that they are returned again by the next read. Return number of lines, less than numLines at end of file, -1 on read or decompression errors
+int hyperspectral_reader_peek_lines(HyspexReader *reader, int numLines, float *data);
+
+//stop background thread and close file
+void hyperspectral_reader_close(HyspexReader *reader);
 
 #endif
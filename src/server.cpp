@@ -0,0 +1,460 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "server.h"
+#include "protocol.h"
+#include "readimage.h"
+#include "masking.h"
+#include "shard.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+#define MAX_BANDS 100000
+#define MAX_LINE_ELEMENTS (1L << 28)
+
+/**
+ * Masking parameters initialized by masking_init(), per masking type and wavelength grid. 
+ **/
+typedef struct{
+	mutex lock;
+	map<pair<int, vector<float> >, masking_t*> templates;
+} library_cache_t;
+
+/**
+ * Seconds a client may take to send the rest of a started request or to receive a response. 
+ **/
+#define CLIENT_TIMEOUT 10
+
+/**
+ * Client connections with a pending request, waiting for a worker. Idle connections are polled by the listening thread, 
+ * so that workers are only occupied while serving a request. 
+ **/
+typedef struct{
+	mutex lock;
+	condition_variable available;
+	/// Connections with a pending request
+	deque<int> ready;
+	/// Connections whose request has been answered, to be polled again by the listening thread
+	vector<int> returned;
+	bool stopping;
+	/// Write end of pipe waking up the listening thread
+	int wake_fd;
+} client_queue_t;
+
+volatile sig_atomic_t server_stop_requested = 0;
+int server_wake_fd = -1;
+
+void server_signal_handler(int){
+	server_stop_requested = 1;
+	if (write(server_wake_fd, "", 1) < 0){
+		//pipe full, the listening thread wakes up anyway
+	}
+}
+
+/**
+ * Get fresh masking parameters for the specified wavelength grid, from cache if possible. 
+ * \return Masking error value, MASKING_NO_ERR on success
+ **/
+masking_err_t library_cache_get(library_cache_t *cache, masking_input_data_type_t masking_type, vector<float> wlens, masking_t *mask_param){
+	pair<int, vector<float> > key(masking_type, wlens);
+	{
+		lock_guard<mutex> guard(cache->lock);
+		map<pair<int, vector<float> >, masking_t*>::iterator it = cache->templates.find(key);
+		if (it != cache->templates.end()){
+			masking_copy(mask_param, it->second);
+			return MASKING_NO_ERR;
+		}
+	}
+
+	//read and resample the spectral library without holding the lock, so that requests for cached grids are not blocked
+	masking_t *cached = new masking_t;
+	masking_err_t errcode = masking_init(wlens.size(), &wlens[0], masking_type, cached);
+	if (errcode != MASKING_NO_ERR){
+		delete cached;
+		return errcode;
+	}
+
+	lock_guard<mutex> guard(cache->lock);
+	pair<map<pair<int, vector<float> >, masking_t*>::iterator, bool> inserted = cache->templates.insert(make_pair(key, cached));
+	if (inserted.second){
+		fprintf(stderr, "Cached reference spectra for %zu bands\n", wlens.size());
+	} else {
+		//another worker initialized the same grid in the meantime
+		masking_free(cached);
+		delete cached;
+	}
+	masking_copy(mask_param, inserted.first->second);
+	return MASKING_NO_ERR;
+}
+
+void library_cache_free(library_cache_t *cache){
+	for (map<pair<int, vector<float> >, masking_t*>::iterator it = cache->templates.begin(); it != cache->templates.end(); it++){
+		masking_free(it->second);
+		delete it->second;
+	}
+	cache->templates.clear();
+}
+
+void set_error(protocol_response_t *response, const char *message){
+	response->status = PROTOCOL_ERR;
+	snprintf(response->message, PROTOCOL_MAX_MESSAGE, "%s", message);
+}
+
+/**
+ * Create shared memory for the mask of the response. 
+ * \return Mapped mask, NULL on failure
+ **/
+unsigned char *create_response_mask(protocol_response_t *response, int *mask_fd){
+	size_t size = (size_t)response->lines*response->samples;
+	*mask_fd = protocol_create_shared_memory(size);
+	if (*mask_fd < 0){
+		set_error(response, "Could not create shared memory for mask");
+		return NULL;
+	}
+	void *mask = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *mask_fd, 0);
+	if (mask == MAP_FAILED){
+		close(*mask_fd);
+		*mask_fd = -1;
+		set_error(response, "Could not map shared memory for mask");
+		return NULL;
+	}
+	return (unsigned char*)mask;
+}
+
+/**
+ * Mask hyperspectral image file. 
+ * \return File descriptor containing the mask, -1 on failure
+ **/
+int serve_file_request(library_cache_t *cache, protocol_request_t *request, protocol_response_t *response){
+	request->filename[PROTOCOL_MAX_PATH-1] = '\0';
+	HyspexHeader header;
+	hyperspectral_err_t read_errcode = hyperspectral_try_read_header(request->filename, &header);
+	if ((read_errcode == HYPERSPECTRAL_NO_ERR) && ((header.bands > MAX_BANDS) || ((long)header.samples*header.bands > MAX_LINE_ELEMENTS))){
+		read_errcode = HYPERSPECTRAL_INVALID_DIMENSIONS;
+	}
+	HyspexReader reader;
+	if (read_errcode == HYPERSPECTRAL_NO_ERR){
+		read_errcode = hyperspectral_try_reader_open(&reader, request->filename, &header);
+	}
+	if (read_errcode != HYPERSPECTRAL_NO_ERR){
+		set_error(response, hyperspectral_error_message(read_errcode));
+		return -1;
+	}
+
+	masking_t mask_param;
+	masking_err_t errcode = library_cache_get(cache, (masking_input_data_type_t)request->masking_type, header.wlens, &mask_param);
+	if (errcode != MASKING_NO_ERR){
+		hyperspectral_reader_close(&reader);
+		set_error(response, masking_error_message(errcode));
+		return -1;
+	}
+
+	response->samples = header.samples;
+	response->lines = header.lines;
+	int mask_fd;
+	unsigned char *mask = create_response_mask(response, &mask_fd);
+	if (mask != NULL){
+		if (mask_image_lines(&reader, &mask_param, header.lines, mask) < 0){
+			set_error(response, "Image ended early or could not be read");
+			close(mask_fd);
+			mask_fd = -1;
+		}
+		munmap(mask, (size_t)header.lines*header.samples);
+	}
+	hyperspectral_reader_close(&reader);
+	masking_free(&mask_param);
+	return mask_fd;
+}
+
+/**
+ * Mask BIL data passed in shared memory. 
+ * \return File descriptor containing the mask, -1 on failure
+ **/
+int serve_data_request(library_cache_t *cache, protocol_request_t *request, int data_fd, const vector<float> &wlens, protocol_response_t *response){
+	size_t line_size = (size_t)request->samples*request->bands;
+	size_t data_size = sizeof(float)*line_size*request->lines;
+	struct stat data_stat;
+	if ((data_fd < 0) || (fstat(data_fd, &data_stat) < 0) || ((size_t)data_stat.st_size < data_size)){
+		set_error(response, "Missing or too small image data");
+		return -1;
+	}
+	const float *data = (const float*)mmap(NULL, data_size, PROT_READ, MAP_SHARED, data_fd, 0);
+	if (data == MAP_FAILED){
+		set_error(response, "Could not map image data");
+		return -1;
+	}
+
+	masking_t mask_param;
+	masking_err_t errcode = library_cache_get(cache, (masking_input_data_type_t)request->masking_type, wlens, &mask_param);
+	if (errcode != MASKING_NO_ERR){
+		munmap((void*)data, data_size);
+		set_error(response, masking_error_message(errcode));
+		return -1;
+	}
+
+	response->samples = request->samples;
+	response->lines = request->lines;
+	int mask_fd;
+	unsigned char *mask = create_response_mask(response, &mask_fd);
+	if (mask != NULL){
+		mask_thresh_t thresh_val = masking_allocate_thresh(&mask_param, request->samples);
+		for (int i=0; i < request->lines; i++){
+			masking_output_t output;
+			output.mask = mask + (size_t)i*request->samples;
+			output.min_angle = NULL;
+			output.best_reference = NULL;
+			masking_thresh_output(&mask_param, request->samples, data + i*line_size, 1, request->samples, &thresh_val, &output);
+		}
+		masking_free_thresh(&thresh_val, request->samples);
+		munmap(mask, (size_t)request->lines*request->samples);
+	}
+	masking_free(&mask_param);
+	munmap((void*)data, data_size);
+	return mask_fd;
+}
+
+/**
+ * Serve one request from client. 
+ * \return true if the connection can be used for further requests
+ **/
+bool serve_request(library_cache_t *cache, int client){
+	protocol_request_t request;
+	int data_fd;
+	if (!protocol_recv(client, &request, sizeof(request), &data_fd)){
+		return false;
+	}
+
+	protocol_response_t response;
+	memset(&response, 0, sizeof(response));
+	response.status = PROTOCOL_OK;
+	int mask_fd = -1;
+	bool close_connection = false;
+
+	if ((request.masking_type != REFLECTANCE_MASKING) && (request.masking_type != TRANSMITTANCE_MASKING)){
+		set_error(&response, "Unknown masking type");
+	} else if (request.type == PROTOCOL_REQUEST_FILE){
+		mask_fd = serve_file_request(cache, &request, &response);
+	} else if (request.type == PROTOCOL_REQUEST_DATA){
+		//the wavelengths that follow cannot be skipped without a valid number of bands, so the connection is closed after the response
+		bool valid_bands = (request.bands > 0) && (request.bands <= MAX_BANDS);
+		vector<float> wlens(valid_bands ? request.bands : 0);
+		if (valid_bands && !protocol_recv(client, &wlens[0], sizeof(float)*request.bands, NULL)){
+			if (data_fd >= 0){
+				close(data_fd);
+			}
+			return false;
+		}
+		if (!valid_bands || (request.samples <= 0) || (request.lines <= 0) || ((long)request.samples*request.bands > MAX_LINE_ELEMENTS)){
+			set_error(&response, "Invalid image dimensions");
+		} else {
+			mask_fd = serve_data_request(cache, &request, data_fd, wlens, &response);
+		}
+		close_connection = !valid_bands;
+	} else {
+		set_error(&response, "Unknown request type");
+	}
+
+	if (data_fd >= 0){
+		close(data_fd);
+	}
+	bool sent = protocol_send(client, &response, sizeof(response), mask_fd);
+	if (mask_fd >= 0){
+		close(mask_fd);
+	}
+	return sent && !close_connection;
+}
+
+void server_wake(client_queue_t *queue){
+	if (write(queue->wake_fd, "", 1) < 0){
+		//pipe full, the listening thread wakes up anyway
+	}
+}
+
+void server_worker(library_cache_t *cache, client_queue_t *queue){
+	while (true){
+		int client;
+		{
+			unique_lock<mutex> guard(queue->lock);
+			while (queue->ready.empty() && !queue->stopping){
+				queue->available.wait(guard);
+			}
+			if (queue->ready.empty()){
+				return;
+			}
+			client = queue->ready.front();
+			queue->ready.pop_front();
+		}
+
+		//hand connection back to the listening thread, unless it was closed or the server is stopping
+		bool keep_open = serve_request(cache, client);
+		lock_guard<mutex> guard(queue->lock);
+		if (keep_open && !queue->stopping){
+			queue->returned.push_back(client);
+			server_wake(queue);
+		} else {
+			close(client);
+		}
+	}
+}
+
+int masking_server_run(const char *socket_path, int num_workers){
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0){
+		fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+		return -1;
+	}
+	unlink(socket_path);
+
+	//restrict socket to the server user independently of umask, before connections are accepted
+	if ((bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0) || (chmod(socket_path, S_IRUSR | S_IWUSR) < 0) || (listen(listener, SOMAXCONN) < 0)){
+		fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+		close(listener);
+		return -1;
+	}
+
+	//workers should not receive the stop signals, so that they interrupt poll() in this thread
+	sigset_t stop_signals, old_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &old_signals);
+
+	int wake_pipe[2];
+	if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0){
+		fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+		close(listener);
+		return -1;
+	}
+	server_wake_fd = wake_pipe[1];
+
+	library_cache_t cache;
+	client_queue_t queue;
+	queue.stopping = false;
+	queue.wake_fd = wake_pipe[1];
+	vector<thread> workers;
+	for (int i=0; i < num_workers; i++){
+		workers.push_back(thread(server_worker, &cache, &queue));
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_signal_handler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	fprintf(stderr, "Listening on %s with %d workers\n", socket_path, num_workers);
+	vector<int> idle_clients;
+	while (!server_stop_requested){
+		vector<struct pollfd> fds(2 + idle_clients.size());
+		fds[0].fd = wake_pipe[0];
+		fds[1].fd = listener;
+		for (size_t i=0; i < idle_clients.size(); i++){
+			fds[2 + i].fd = idle_clients[i];
+		}
+		for (size_t i=0; i < fds.size(); i++){
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if (poll(&fds[0], fds.size(), -1) < 0){
+			if (errno != EINTR){
+				fprintf(stderr, "Could not poll connections: %s\n", strerror(errno));
+			}
+			continue;
+		}
+
+		char wake_bytes[64];
+		while (read(wake_pipe[0], wake_bytes, sizeof(wake_bytes)) > 0){
+		}
+
+		//connections with a request or a hangup go to the workers, which also detect closed connections
+		vector<int> still_idle;
+		{
+			lock_guard<mutex> guard(queue.lock);
+			for (size_t i=0; i < idle_clients.size(); i++){
+				if (fds[2 + i].revents != 0){
+					queue.ready.push_back(idle_clients[i]);
+					queue.available.notify_one();
+				} else {
+					still_idle.push_back(idle_clients[i]);
+				}
+			}
+			still_idle.insert(still_idle.end(), queue.returned.begin(), queue.returned.end());
+			queue.returned.clear();
+		}
+		idle_clients.swap(still_idle);
+
+		if (fds[1].revents & POLLIN){
+			int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (client < 0){
+				if (errno != EINTR){
+					fprintf(stderr, "Could not accept connection: %s\n", strerror(errno));
+				}
+				continue;
+			}
+
+			//clients that stall in the middle of a request should not block a worker for long
+			struct timeval timeout;
+			timeout.tv_sec = CLIENT_TIMEOUT;
+			timeout.tv_usec = 0;
+			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			idle_clients.push_back(client);
+		}
+	}
+
+	//close idle connections, finish pending requests, then stop
+	for (size_t i=0; i < idle_clients.size(); i++){
+		close(idle_clients[i]);
+	}
+	{
+		lock_guard<mutex> guard(queue.lock);
+		queue.stopping = true;
+		queue.available.notify_all();
+	}
+	for (int i=0; i < (int)workers.size(); i++){
+		workers[i].join();
+	}
+	for (size_t i=0; i < queue.returned.size(); i++){
+		close(queue.returned[i]);
+	}
+	server_wake_fd = -1;
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	close(listener);
+	unlink(socket_path);
+	library_cache_free(&cache);
+	fprintf(stderr, "Masking server stopped\n");
+	return 0;
+}
@@ -0,0 +1,25 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef SERVER_H_DEFINED
+#define SERVER_H_DEFINED
+
+/**
+ * Run resident masking server on a local Unix domain socket until SIGINT or SIGTERM, see protocol.h for the messages. 
+ * Requests are served by a pool of worker threads, idle connections are polled and do not occupy a worker. Reference spectra resampled by masking_init() are cached per wavelength grid, 
+ * so that each request only pays for copying the cached masking parameters. 
+ * 
+ * The socket is only accessible to the user running the server. File requests can read any image the server can read, so 
+ * the server should not be run with more permissions than the clients should have, and the socket should not be made 
+ * accessible to other users. 
+ * \param socket_path Filename of the socket
+ * \param num_workers Number of worker threads
+ * \return 0 on normal shutdown, -1 if the socket could not be set up
+ **/
+int masking_server_run(const char *socket_path, int num_workers);
+
+#endif
@@ -0,0 +1,374 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <algorithm>
+using namespace std;
+
+const int MAX_SHM_NAME = 64;
+
+long mask_image_lines(HyspexReader *reader, masking_t *mask_param, int num_lines, unsigned char *mask, float *min_angle, unsigned short *best_reference, const masking_coarse_t *coarse, int batch_lines, masking_budget_t *budget, masking_coarse_state_t *coarse_state){
+	HyspexHeader *header = &(reader->header);
+
+	//coarse-to-fine and batch masking work on blocks of lines
+	int num_block_lines = 1;
+	if ((coarse != NULL) && (coarse->block_size > 0)){
+		num_block_lines = coarse->block_size;
+	} else if (batch_lines > 0){
+		num_block_lines = batch_lines;
+	}
+	mask_thresh_t *thresh_val = new mask_thresh_t[num_block_lines];
+	masking_output_t *output = new masking_output_t[num_block_lines];
+	for (int i=0; i < num_block_lines; i++){
+		thresh_val[i] = masking_allocate_thresh(mask_param, header->samples);
+	}
+	long line_size = (long)header->samples*header->bands;
+
+	//coarse-to-fine masking looks one block row ahead. Without state from the caller, only within the lines masked here
+	int num_lookahead_lines = 0;
+	masking_coarse_state_t local_coarse_state;
+	if (coarse != NULL){
+		num_lookahead_lines = num_block_lines;
+		if (coarse_state == NULL){
+			masking_coarse_state_init(mask_param, header->samples, coarse, &local_coarse_state);
+		}
+	}
+	float *lines = new float[(num_block_lines + num_lookahead_lines)*line_size];
+	long num_classified = 0;
+
+	for (int i=0; i < num_lines; i += num_block_lines){
+		int block_lines = min(num_block_lines, num_lines - i);
+
+		//read lines
+		int lines_read = hyperspectral_reader_read_lines(reader, block_lines, lines);
+		if (lines_read < block_lines){
+			if (lines_read < 0){
+				fprintf(stderr, "Could not read or decompress image data after %d lines.\n", reader->linesRead);
+			} else {
+				fprintf(stderr, "Image ended after %d lines.\n", reader->linesRead);
+			}
+			num_classified = -1;
+			break;
+		}
+		for (int l=0; l < block_lines; l++){
+			size_t offset = (size_t)(i + l)*header->samples;
+			output[l].mask = mask + offset;
+			output[l].min_angle = (min_angle != NULL) ? min_angle + offset : NULL;
+			output[l].best_reference = (best_reference != NULL) ? best_reference + offset : NULL;
+		}
+
+		//mask lines
+		if (coarse != NULL){
+			int next_lines = (coarse_state != NULL) ? num_lookahead_lines : min(num_lookahead_lines, num_lines - i - block_lines);
+			if (next_lines > 0){
+				next_lines = hyperspectral_reader_peek_lines(reader, next_lines, lines + block_lines*line_size);
+				if (next_lines < 0){
+					fprintf(stderr, "Could not read or decompress image data after %d lines.\n", reader->linesRead);
+					num_classified = -1;
+					break;
+				}
+			}
+			num_classified += masking_thresh_coarse_to_fine(mask_param, header->samples, block_lines, lines, 1, header->samples, line_size, coarse, thresh_val, output, (coarse_state != NULL) ? coarse_state : &local_coarse_state, next_lines);
+		} else if (batch_lines > 0){
+			masking_thresh_batch(mask_param, header->samples, block_lines, lines, thresh_val, output);
+			num_classified += (long)block_lines*header->samples;
+		} else if (budget != NULL){
+			masking_thresh_budget(mask_param, budget, header->samples, lines, 1, header->samples, &thresh_val[0], &output[0]);
+			num_classified += header->samples;
+		} else {
+			masking_thresh_output(mask_param, header->samples, lines, 1, header->samples, &thresh_val[0], &output[0]);
+			num_classified += header->samples;
+		}
+	}
+
+	delete [] lines;
+	if ((coarse != NULL) && (coarse_state == NULL)){
+		masking_coarse_state_free(&local_coarse_state);
+	}
+	for (int i=0; i < num_block_lines; i++){
+		masking_free_thresh(&thresh_val[i], header->samples);
+	}
+	delete [] thresh_val;
+	delete [] output;
+	return num_classified;
+}
+
+/**
+ * Layout of the adaptive masking state of one shard in shared memory. 
+ **/
+typedef struct{
+	/// Number of pixels classified at full resolution
+	long *num_classified;
+	/// Number of pixels tested and rejected by the pre-filter in this shard
+	long *prefilter_stats;
+	/// Number of samples used in each updated spectrum, num_masking_spectra values
+	long *num_samples_in_spectra;
+	/// Updated spectra, num_masking_spectra*num_bands values
+	float *updated_spectra;
+} shard_state_t;
+
+/**
+ * Size of the adaptive masking state of one shard in shared memory. Rounded up to keep the next state aligned. 
+ **/
+size_t shard_state_size(const masking_t *mask_param){
+	size_t size = sizeof(long)*(3 + mask_param->num_masking_spectra) + sizeof(float)*mask_param->num_masking_spectra*mask_param->num_bands;
+	return (size + sizeof(long) - 1)/sizeof(long)*sizeof(long);
+}
+
+shard_state_t shard_state_at(char *memory, const masking_t *mask_param, int shard){
+	shard_state_t state;
+	char *start = memory + shard*shard_state_size(mask_param);
+	state.num_classified = (long*)start;
+	state.prefilter_stats = state.num_classified + 1;
+	state.num_samples_in_spectra = state.prefilter_stats + 2;
+	state.updated_spectra = (float*)(state.num_samples_in_spectra + mask_param->num_masking_spectra);
+	return state;
+}
+
+/**
+ * Map shared memory, inherited by forked workers. Exits on failure. 
+ **/
+char *shard_map_shared(size_t bytes){
+	char shm_name[MAX_SHM_NAME];
+	snprintf(shm_name, MAX_SHM_NAME, "/masking-bin-%d", (int)getpid());
+	int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0){
+		fprintf(stderr, "Could not create shared memory %s: %s\n", shm_name, strerror(errno));
+		exit(1);
+	}
+	shm_unlink(shm_name);
+	if (ftruncate(fd, bytes) < 0){
+		fprintf(stderr, "Could not allocate %zu bytes of shared memory: %s\n", bytes, strerror(errno));
+		exit(1);
+	}
+	char *memory = (char*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED){
+		fprintf(stderr, "Could not map shared memory: %s\n", strerror(errno));
+		exit(1);
+	}
+	return memory;
+}
+
+/**
+ * Size of the outputs of a shard in shared memory: SAM angles and reference indices if requested, followed by the mask. 
+ **/
+size_t shard_output_size(const shard_run_t *run, int shard){
+	size_t num_pixels = (size_t)(run->end_lines[shard] - run->start_lines[shard])*run->header.samples;
+	return run->qa_outputs ? num_pixels*(sizeof(float) + sizeof(unsigned short) + 1) : num_pixels;
+}
+
+/**
+ * Outputs of a shard in its output segment, in the layout of shard_output_size(). Angles and reference indices are NULL unless output. 
+ **/
+void shard_output_at(const shard_run_t *run, int shard, unsigned char **mask, float **min_angle, unsigned short **best_reference){
+	size_t num_pixels = (size_t)(run->end_lines[shard] - run->start_lines[shard])*run->header.samples;
+	char *memory = run->output_memory[shard];
+	*min_angle = run->qa_outputs ? (float*)memory : NULL;
+	*best_reference = run->qa_outputs ? (unsigned short*)(memory + sizeof(float)*num_pixels) : NULL;
+	*mask = (unsigned char*)(run->qa_outputs ? memory + (sizeof(float) + sizeof(unsigned short))*num_pixels : memory);
+}
+
+/**
+ * Fork one worker per shard, each masking its shard into its own output segment. 
+ * \param qa_outputs Whether the workers output SAM angles and reference indices
+ **/
+void shard_start_workers(shard_run_t *run, bool qa_outputs){
+	fflush(stdout);
+	fflush(stderr);
+	masking_prefilter_stats_t base_stats;
+	masking_get_prefilter_stats(run->mask_param, &base_stats);
+	run->next_shard = 0;
+	run->qa_outputs = qa_outputs;
+	for (int s=0; s < run->num_shards; s++){
+		run->output_memory[s] = shard_map_shared(shard_output_size(run, s));
+	}
+	for (int s=0; s < run->num_shards; s++){
+		run->workers[s] = fork();
+		if (run->workers[s] < 0){
+			fprintf(stderr, "Could not start masking worker: %s\n", strerror(errno));
+			exit(1);
+		} else if (run->workers[s] == 0){
+			//worker: mask shard using its own copy of the masking parameters, report back adaptive state
+			masking_t *mask_param = run->mask_param;
+			unsigned char *mask;
+			float *min_angle;
+			unsigned short *best_reference;
+			shard_output_at(run, s, &mask, &min_angle, &best_reference);
+			HyspexReader reader;
+			hyperspectral_reader_open(&reader, run->filename, &(run->header), run->start_lines[s]);
+			long num_classified = mask_image_lines(&reader, mask_param, run->end_lines[s] - run->start_lines[s], mask, min_angle, best_reference, run->coarse, run->batch_lines);
+			hyperspectral_reader_close(&reader);
+			if (num_classified < 0){
+				_exit(1);
+			}
+			shard_state_t state = shard_state_at(run->state_memory, mask_param, s);
+			*(state.num_classified) = num_classified;
+			masking_prefilter_stats_t stats;
+			masking_get_prefilter_stats(mask_param, &stats);
+			state.prefilter_stats[0] = stats.num_tested - base_stats.num_tested;
+			state.prefilter_stats[1] = stats.num_rejected - base_stats.num_rejected;
+			for (int k=0; k < mask_param->num_masking_spectra; k++){
+				state.num_samples_in_spectra[k] = mask_param->num_samples_in_spectra[k];
+				memcpy(state.updated_spectra + k*mask_param->num_bands, mask_param->updated_spectra[k], sizeof(float)*mask_param->num_bands);
+			}
+			_exit(0);
+		}
+	}
+	run->num_classified = 0;
+}
+
+/**
+ * Wait for the worker of the next shard, add its statistics. Stops all workers and exits on worker failure. 
+ * \return Shard
+ **/
+int shard_wait_next(shard_run_t *run){
+	int shard = run->next_shard++;
+	int status;
+	if ((waitpid(run->workers[shard], &status, 0) < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)){
+		fprintf(stderr, "Masking worker failed.\n");
+		for (int s=shard + 1; s < run->num_shards; s++){
+			kill(run->workers[s], SIGTERM);
+			waitpid(run->workers[s], &status, 0);
+		}
+		exit(1);
+	}
+
+	shard_state_t state = shard_state_at(run->state_memory, run->mask_param, shard);
+	run->num_classified += *(state.num_classified);
+	masking_prefilter_stats_t stats;
+	stats.num_tested = state.prefilter_stats[0];
+	stats.num_rejected = state.prefilter_stats[1];
+	masking_add_prefilter_stats(run->mask_param, &stats);
+	return shard;
+}
+
+/**
+ * Unmap output segment of shard. 
+ **/
+void shard_free_output(shard_run_t *run, int shard){
+	if (run->output_memory[shard] != NULL){
+		munmap(run->output_memory[shard], shard_output_size(run, shard));
+		run->output_memory[shard] = NULL;
+	}
+}
+
+/**
+ * Merge the reference spectra of all shards of the finished pass into the masking parameters. 
+ **/
+void shard_merge_states(shard_run_t *run){
+	masking_t *mask_param = run->mask_param;
+	masking_t *states = new masking_t[run->num_shards];
+	for (int s=0; s < run->num_shards; s++){
+		shard_state_t state = shard_state_at(run->state_memory, mask_param, s);
+		states[s] = *mask_param;
+		states[s].num_samples_in_spectra = state.num_samples_in_spectra;
+		states[s].updated_spectra = new float*[mask_param->num_masking_spectra];
+		for (int k=0; k < mask_param->num_masking_spectra; k++){
+			states[s].updated_spectra[k] = state.updated_spectra + k*mask_param->num_bands;
+		}
+	}
+	masking_merge_state(mask_param, run->num_shards, states);
+	for (int s=0; s < run->num_shards; s++){
+		delete [] states[s].updated_spectra;
+	}
+	delete [] states;
+}
+
+void mask_image_sharded_start(char *filename, HyspexHeader *header, masking_t *mask_param, int num_shards, bool second_pass, bool qa_outputs, const masking_coarse_t *coarse, int batch_lines, shard_run_t *run){
+	if (num_shards > header->lines){
+		num_shards = header->lines;
+	}
+	if (num_shards < 1){
+		num_shards = 1;
+	}
+	if ((num_shards > 1) && !hyperspectral_reader_can_seek(filename)){
+		//each shard would decompress and discard all lines before its start line
+		fprintf(stderr, "Cannot shard %s: compressed images must be zstd in the seekable format to be split into shards (-j)\n", filename);
+		exit(1);
+	}
+
+	run->filename = filename;
+	run->header = *header;
+	run->mask_param = mask_param;
+	run->num_shards = num_shards;
+	run->second_pass = second_pass;
+	run->coarse = coarse;
+	run->batch_lines = batch_lines;
+	run->workers = new pid_t[num_shards];
+	run->start_lines = new int[num_shards];
+	run->end_lines = new int[num_shards];
+	run->output_memory = new char*[num_shards];
+	for (int s=0; s < num_shards; s++){
+		int start_line = (long)header->lines*s/num_shards;
+		int end_line = (long)header->lines*(s+1)/num_shards;
+		if ((coarse != NULL) && (coarse->block_size > 1)){
+			//keep the block rows of all shards on the same grid as in serial masking
+			start_line -= start_line % coarse->block_size;
+			end_line = (s == num_shards - 1) ? end_line : end_line - end_line % coarse->block_size;
+		}
+		run->start_lines[s] = start_line;
+		run->end_lines[s] = end_line;
+	}
+	run->state_memory = shard_map_shared(shard_state_size(mask_param)*num_shards);
+
+	//first pass of two: mask all shards and discard their outputs, merge their reference spectra
+	if (second_pass){
+		shard_start_workers(run, false);
+		while (run->next_shard < run->num_shards){
+			shard_free_output(run, shard_wait_next(run));
+		}
+		shard_merge_states(run);
+	}
+
+	//last pass, collected by mask_image_sharded_next()
+	shard_start_workers(run, qa_outputs);
+}
+
+int mask_image_sharded_next(shard_run_t *run, unsigned char **mask, float **min_angle, unsigned short **best_reference){
+	//outputs of the previous shard have been consumed
+	if (run->next_shard > 0){
+		shard_free_output(run, run->next_shard - 1);
+	}
+	if (run->next_shard == run->num_shards){
+		return 0;
+	}
+
+	int shard = shard_wait_next(run);
+	shard_output_at(run, shard, mask, min_angle, best_reference);
+	return run->end_lines[shard] - run->start_lines[shard];
+}
+
+long mask_image_sharded_finish(shard_run_t *run){
+	while (run->next_shard < run->num_shards){
+		shard_free_output(run, shard_wait_next(run));
+	}
+	for (int s=0; s < run->num_shards; s++){
+		shard_free_output(run, s);
+	}
+
+	//single pass: merge reference spectra of the last pass
+	if (!run->second_pass){
+		shard_merge_states(run);
+	}
+	munmap(run->state_memory, shard_state_size(run->mask_param)*run->num_shards);
+	delete [] run->workers;
+	delete [] run->start_lines;
+	delete [] run->end_lines;
+	delete [] run->output_memory;
+	return run->num_classified;
+}
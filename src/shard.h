@@ -0,0 +1,96 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef SHARD_H_DEFINED
+#define SHARD_H_DEFINED
+
+#include "readimage.h"
+#include "masking.h"
+
+/**
+ * Mask the next lines of a hyperspectral image. 
+ * \param reader Hyperspectral image reader, positioned at the first line to mask
+ * \param mask_param Masking parameters, reference spectra are updated as the lines are masked
+ * \param num_lines Number of lines to mask
+ * \param mask Output mask, num_lines*samples values, 1 if pixel belongs to the segmented image
+ * \param min_angle Output minimum SAM angle of each pixel, same size as mask. Can be NULL
+ * \param best_reference Output index of best-matching reference spectrum of each pixel, same size as mask. Can be NULL
+ * \param coarse Parameters for coarse-to-fine masking of blocks of lines, see masking_thresh_coarse_to_fine(). NULL for full resolution masking
+ * \param batch_lines Mask blocks of this many lines in batch, see masking_thresh_batch(). 0 to mask line by line. Ignored in coarse-to-fine masking
+ * \param budget Latency budget state for masking line by line, see masking_thresh_budget(). NULL for no latency budget. Ignored in coarse-to-fine and batch masking
+ * \param coarse_state Coarse-to-fine state for masking an image in several calls. The next block row is then peeked from the reader, also beyond num_lines, 
+ * and num_lines should be a multiple of the block size unless the image ends. NULL to compare blocks only within the masked lines
+ * \return Number of pixels classified at full resolution, -1 if the image ended early or could not be read
+ **/
+long mask_image_lines(HyspexReader *reader, masking_t *mask_param, int num_lines, unsigned char *mask, float *min_angle = NULL, unsigned short *best_reference = NULL, const masking_coarse_t *coarse = NULL, int batch_lines = 0, masking_budget_t *budget = NULL, masking_coarse_state_t *coarse_state = NULL);
+
+/**
+ * Sharded masking of a hyperspectral image in progress, see mask_image_sharded_start(). 
+ **/
+typedef struct{
+	char *filename;
+	HyspexHeader header;
+	masking_t *mask_param;
+	int num_shards;
+	bool second_pass;
+	const masking_coarse_t *coarse;
+	int batch_lines;
+	/// Line range of each shard
+	int *start_lines;
+	int *end_lines;
+	/// Worker process of each shard in the current pass
+	pid_t *workers;
+	/// Next shard to wait for in the current pass
+	int next_shard;
+	/// Whether the workers of the current pass output SAM angles and reference indices
+	bool qa_outputs;
+	/// Shared memory of the adaptive states of all shards
+	char *state_memory;
+	/// Shared memory of the outputs of each shard in the current pass, NULL when freed
+	char **output_memory;
+	/// Number of pixels classified at full resolution by the shards waited for in the current pass
+	long num_classified;
+} shard_run_t;
+
+/**
+ * Start masking the full hyperspectral image using several worker processes. The line range is split into one shard per worker, 
+ * each worker masks its shard with its own copy of the masking parameters and returns its outputs and the sufficient statistics
+ * of its updated reference spectra through POSIX shared memory, one segment per shard. The statistics are merged into mask_param. 
+ * The outputs are collected shard by shard in line order using mask_image_sharded_next(), so that the coordinator does not hold 
+ * whole-image outputs. Compressed images must be zstd in the seekable format, so that workers start decompressing at the frame 
+ * containing their first line, exits otherwise. In coarse-to-fine masking, shards start at multiples of the block size, and blocks 
+ * are only compared with neighbouring blocks in the same shard. 
+ * \param filename Hyperspectral image filename
+ * \param header Hyperspectral image header
+ * \param mask_param Masking parameters, contains the merged reference spectra after mask_image_sharded_finish()
+ * \param num_shards Number of worker processes
+ * \param second_pass Whether to mask the image once more using the merged reference spectra. The first pass runs to completion here
+ * \param qa_outputs Whether to output minimum SAM angles and best-matching reference spectra
+ * \param coarse Parameters for coarse-to-fine masking, NULL for full resolution masking
+ * \param batch_lines Number of lines masked in batch, 0 to mask line by line
+ * \param run Output sharded masking state
+ **/
+void mask_image_sharded_start(char *filename, HyspexHeader *header, masking_t *mask_param, int num_shards, bool second_pass, bool qa_outputs, const masking_coarse_t *coarse, int batch_lines, shard_run_t *run);
+
+/**
+ * Wait for the next shard of the last pass and return its outputs. They are valid until the next call, which frees them. Exits on worker failure. 
+ * \param run Sharded masking state
+ * \param mask Output mask of the lines of the shard
+ * \param min_angle Output minimum SAM angles, same size as mask. NULL unless qa_outputs was set
+ * \param best_reference Output indices of best-matching reference spectra, same size as mask. NULL unless qa_outputs was set
+ * eturn Number of lines in the shard, 0 when all shards have been returned
+ **/
+int mask_image_sharded_next(shard_run_t *run, unsigned char **mask, float **min_angle, unsigned short **best_reference);
+
+/**
+ * Wait for the remaining shards, merge the reference spectra if masked in a single pass and free the sharded masking state. 
+ * \param run Sharded masking state
+ * eturn Number of pixels classified at full resolution in the last pass
+ **/
+long mask_image_sharded_finish(shard_run_t *run);
+
+#endif
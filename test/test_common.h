@@ -0,0 +1,133 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#ifndef TEST_COMMON_H_DEFINED
+#define TEST_COMMON_H_DEFINED
+
+#include "masking.h"
+#include "masking_index.h"
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+/**
+ * Number of failed checks in the test executable.
+ **/
+static int test_num_failures = 0;
+
+/**
+ * Check condition, report failure with location.
+ **/
+#define TEST_CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			test_num_failures++; \
+		} \
+	} while (0)
+
+/**
+ * Deterministic pseudo-random number in [0, 1), so that the tests do not depend on the platform rand().
+ **/
+inline float test_random(unsigned int *seed){
+	*seed = *seed*1103515245u + 12345u;
+	return ((*seed >> 8) & 0xffffff)/16777216.0f;
+}
+
+/**
+ * Set up masking parameters from synthetic reference spectra, as masking_init() does from the spectral library, so that the tests do
+ * not depend on the spectral library directories. The reference spectra are spread around num_clusters random centers.
+ * \param num_spectra Number of reference spectra
+ * \param num_bands Number of bands
+ * \param num_clusters Number of cluster centers
+ * \param sam_thresh SAM threshold of all reference spectra
+ * \param seed Random seed
+ * \param mask_param Output masking parameters, must be freed using masking_free()
+ **/
+inline void test_masking_init(int num_spectra, int num_bands, int num_clusters, float sam_thresh, unsigned int seed, masking_t *mask_param){
+	float **centers = new float*[num_clusters];
+	for (int c=0; c < num_clusters; c++){
+		centers[c] = new float[num_bands];
+		for (int i=0; i < num_bands; i++){
+			centers[c][i] = 0.1f + test_random(&seed);
+		}
+	}
+
+	mask_param->num_masking_spectra = num_spectra;
+	mask_param->num_bands = num_bands;
+	mask_param->orig_spectra = new float*[num_spectra];
+	mask_param->updated_spectra = new float*[num_spectra];
+	mask_param->sam_thresh = new float[num_spectra]();
+	mask_param->start_band_ind = 0;
+	mask_param->end_band_ind = num_bands - 1;
+	mask_param->num_samples_in_spectra = new long[num_spectra]();
+	for (int k=0; k < num_spectra; k++){
+		mask_param->orig_spectra[k] = new float[num_bands];
+		mask_param->updated_spectra[k] = new float[num_bands];
+		for (int i=0; i < num_bands; i++){
+			mask_param->orig_spectra[k][i] = centers[k % num_clusters][i]*(0.8f + 0.4f*test_random(&seed));
+			mask_param->updated_spectra[k][i] = mask_param->orig_spectra[k][i];
+		}
+		mask_param->sam_thresh[k] = sam_thresh;
+	}
+	mask_param->index = masking_index_build(mask_param);
+	mask_param->prefilter = NULL;
+
+	for (int c=0; c < num_clusters; c++){
+		delete [] centers[c];
+	}
+	delete [] centers;
+}
+
+/**
+ * Generate BIL image data: noisy, scaled copies of random reference spectra mixed with unrelated spectra, so that the SAM angles are spread
+ * on both sides of the thresholds.
+ * \param mask_param Masking parameters
+ * \param num_samples Number of samples in each line
+ * \param num_lines Number of lines
+ * \param seed Random seed
+ * \return Image data, num_lines*num_bands*num_samples values, must be freed using delete []
+ **/
+inline float *test_generate_image(const masking_t *mask_param, int num_samples, int num_lines, unsigned int seed){
+	int num_bands = mask_param->num_bands;
+	float *data = new float[(long)num_lines*num_bands*num_samples];
+	for (int line=0; line < num_lines; line++){
+		for (int j=0; j < num_samples; j++){
+			int k = (int)(test_random(&seed)*mask_param->num_masking_spectra);
+			bool unrelated = test_random(&seed) < 0.2f;
+			float scale = 0.5f + test_random(&seed);
+			float noise = 1.6f*test_random(&seed);
+			for (int i=0; i < num_bands; i++){
+				float val = unrelated ? 0.1f + test_random(&seed) : mask_param->orig_spectra[k][i]*(1 + noise*(test_random(&seed) - 0.5f));
+				data[((long)line*num_bands + i)*num_samples + j] = scale*val;
+			}
+		}
+	}
+	return data;
+}
+
+/**
+ * Whether two values are equal within a relative tolerance.
+ **/
+inline bool test_close(double a, double b, double tolerance){
+	return fabs(a - b) <= tolerance*std::max(1.0, std::max(fabs(a), fabs(b)));
+}
+
+/**
+ * Report the result of the test executable.
+ * \return Exit code, nonzero if any check failed
+ **/
+inline int test_report(const char *name){
+	if (test_num_failures > 0){
+		fprintf(stderr, "%s: %d checks failed\n", name, test_num_failures);
+		return 1;
+	}
+	fprintf(stderr, "%s: all checks passed\n", name);
+	return 0;
+}
+
+#endif
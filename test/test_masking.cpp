@@ -0,0 +1,766 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "test_common.h"
+#include "masker.h"
+#include <vector>
+using namespace std;
+
+#define NUM_SPECTRA 40
+#define NUM_BANDS 50
+#define NUM_SAMPLES 64
+#define NUM_LINES 24
+
+/**
+ * Mask lines [start_line, end_line) of BIL image data using masking_thresh_strided(). 
+ * \param sums Output sums of the pixels thresholded to each reference spectrum, NUM_SPECTRA*NUM_BANDS values, or NULL
+ * \param counts Output number of pixels thresholded to each reference spectrum, NUM_SPECTRA values, or NULL
+ * \return Number of pixels belonging to the segmented image
+ **/
+long mask_lines(masking_t *mask_param, const float *data, int start_line, int end_line, double *sums = NULL, long *counts = NULL){
+	mask_thresh_t thresh = masking_allocate_thresh(mask_param, NUM_SAMPLES);
+	long num_belonging = 0;
+	for (int line=start_line; line < end_line; line++){
+		const float *line_data = data + (long)line*NUM_BANDS*NUM_SAMPLES;
+		masking_thresh_strided(mask_param, NUM_SAMPLES, line_data, 1, NUM_SAMPLES, &thresh);
+		for (int j=0; j < NUM_SAMPLES; j++){
+			num_belonging += masking_pixel_belongs(mask_param, thresh, j);
+			for (int k=0; (counts != NULL) && (k < NUM_SPECTRA); k++){
+				if (!thresh[j][k]){
+					continue;
+				}
+				counts[k]++;
+				for (int i=0; i < NUM_BANDS; i++){
+					sums[k*NUM_BANDS + i] += line_data[i*NUM_SAMPLES + j];
+				}
+			}
+		}
+	}
+	masking_free_thresh(&thresh, NUM_SAMPLES);
+	return num_belonging;
+}
+
+/**
+ * Allocate thresholded values for each line of an image. 
+ **/
+mask_thresh_t *allocate_image_thresh(const masking_t *mask_param, int num_samples, int num_lines){
+	mask_thresh_t *thresh = new mask_thresh_t[num_lines];
+	for (int i=0; i < num_lines; i++){
+		thresh[i] = masking_allocate_thresh(mask_param, num_samples);
+	}
+	return thresh;
+}
+
+void free_image_thresh(mask_thresh_t *thresh, int num_samples, int num_lines){
+	for (int i=0; i < num_lines; i++){
+		masking_free_thresh(&thresh[i], num_samples);
+	}
+	delete [] thresh;
+}
+
+/**
+ * Mask BIL image line by line using masking_thresh_output(), as the reference for the other masking functions. 
+ **/
+void mask_image_reference(masking_t *mask_param, const float *data, int num_samples, int num_lines, mask_thresh_t *thresh){
+	for (int i=0; i < num_lines; i++){
+		masking_thresh_output(mask_param, num_samples, data + (long)i*NUM_BANDS*num_samples, 1, num_samples, &thresh[i], NULL);
+	}
+}
+
+/**
+ * Whether the thresholded values of two images are identical. 
+ **/
+bool same_thresh(const masking_t *mask_param, mask_thresh_t *thresh_1, mask_thresh_t *thresh_2, int num_samples, int num_lines){
+	for (int i=0; i < num_lines; i++){
+		for (int j=0; j < num_samples; j++){
+			for (int k=0; k < mask_param->num_masking_spectra; k++){
+				if (thresh_1[i][j][k] != thresh_2[i][j][k]){
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Whether the adaptive state of two masking parameter sets is identical. 
+ **/
+bool same_updated_spectra(const masking_t *mask_param_1, const masking_t *mask_param_2){
+	for (int k=0; k < mask_param_1->num_masking_spectra; k++){
+		if (mask_param_1->num_samples_in_spectra[k] != mask_param_2->num_samples_in_spectra[k]){
+			return false;
+		}
+		for (int i=0; i < mask_param_1->num_bands; i++){
+			if (mask_param_1->updated_spectra[k][i] != mask_param_2->updated_spectra[k][i]){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Merged state should be the sample-weighted mean of the states, each started from the common starting point.
+ **/
+void test_merge_state(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 1, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 2);
+
+	//common starting point with samples already in the updated spectra
+	TEST_CHECK(mask_lines(&mask_param, data, 0, NUM_LINES/3) > 0);
+
+	const int num_states = 2;
+	masking_t states[num_states];
+	for (int s=0; s < num_states; s++){
+		masking_copy(&states[s], &mask_param);
+	}
+	//pixels thresholded to each reference spectrum in the part of each state
+	vector<double> sums(NUM_SPECTRA*NUM_BANDS);
+	vector<long> counts(NUM_SPECTRA);
+	mask_lines(&states[0], data, NUM_LINES/3, 2*NUM_LINES/3, &sums[0], &counts[0]);
+	mask_lines(&states[1], data, 2*NUM_LINES/3, NUM_LINES, &sums[0], &counts[0]);
+
+	//merging a single state gives that state
+	masking_t single;
+	masking_copy(&single, &mask_param);
+	masking_merge_state(&single, 1, &states[0]);
+	for (int k=0; k < NUM_SPECTRA; k++){
+		TEST_CHECK(single.num_samples_in_spectra[k] == states[0].num_samples_in_spectra[k]);
+		for (int i=0; i < NUM_BANDS; i++){
+			TEST_CHECK(test_close(single.updated_spectra[k][i], states[0].updated_spectra[k][i], 1e-5));
+		}
+	}
+	masking_free(&single);
+
+	//merging both states gives the mean over the samples of the starting point and all pixels thresholded in either part
+	masking_t merged;
+	masking_copy(&merged, &mask_param);
+	masking_merge_state(&merged, num_states, states);
+	long num_updated = 0;
+	for (int k=0; k < NUM_SPECTRA; k++){
+		long n_base = mask_param.num_samples_in_spectra[k];
+		TEST_CHECK(merged.num_samples_in_spectra[k] == n_base + counts[k]);
+		num_updated += (counts[k] > 0);
+		for (int i=0; i < NUM_BANDS; i++){
+			double expected = mask_param.updated_spectra[k][i];
+			if (counts[k] > 0){
+				expected = (n_base*(double)mask_param.updated_spectra[k][i] + sums[k*NUM_BANDS + i])/(n_base + counts[k]);
+			}
+			TEST_CHECK(test_close(merged.updated_spectra[k][i], expected, 1e-4));
+		}
+	}
+	TEST_CHECK(num_updated > 0);
+	masking_free(&merged);
+
+	for (int s=0; s < num_states; s++){
+		masking_free(&states[s]);
+	}
+	delete [] data;
+	masking_free(&mask_param);
+}
+
+/**
+ * Coarse-to-fine masking with single-pixel blocks classifies every pixel in line order, and should equal masking_thresh_output(). 
+ **/
+void test_coarse_single_pixel_blocks(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 3, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 4);
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_image_reference(&reference_param, data, NUM_SAMPLES, NUM_LINES, reference);
+
+	masking_coarse_t coarse = {1, 0.0f};
+	mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	long num_classified = masking_thresh_coarse_to_fine(&mask_param, NUM_SAMPLES, NUM_LINES, data, 1, NUM_SAMPLES, NUM_BANDS*NUM_SAMPLES, &coarse, thresh, NULL, NULL, 0);
+	TEST_CHECK(num_classified == NUM_SAMPLES*NUM_LINES);
+	TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+	TEST_CHECK(same_updated_spectra(&mask_param, &reference_param));
+
+	free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+	free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * Coarse-to-fine masking in consecutive calls with state should give the same results as one call over the whole image. 
+ **/
+void test_coarse_chunked(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 5, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 6);
+	long line_stride = NUM_BANDS*NUM_SAMPLES;
+	masking_coarse_t coarse = {4, 0.05f};
+
+	masking_t whole_param;
+	masking_copy(&whole_param, &mask_param);
+	mask_thresh_t *whole = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	long whole_classified = masking_thresh_coarse_to_fine(&whole_param, NUM_SAMPLES, NUM_LINES, data, 1, NUM_SAMPLES, line_stride, &coarse, whole, NULL, NULL, 0);
+	TEST_CHECK(whole_classified < NUM_SAMPLES*NUM_LINES);
+
+	int chunk_sizes[2] = {coarse.block_size, 3*coarse.block_size};
+	for (int c=0; c < 2; c++){
+		masking_t chunked_param;
+		masking_copy(&chunked_param, &mask_param);
+		mask_thresh_t *chunked = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+		masking_coarse_state_t state;
+		masking_coarse_state_init(&chunked_param, NUM_SAMPLES, &coarse, &state);
+		long chunked_classified = 0;
+		for (int start_line=0; start_line < NUM_LINES; start_line += chunk_sizes[c]){
+			int num_lines = min(chunk_sizes[c], NUM_LINES - start_line);
+			int num_next_lines = min(coarse.block_size, NUM_LINES - start_line - num_lines);
+			chunked_classified += masking_thresh_coarse_to_fine(&chunked_param, NUM_SAMPLES, num_lines, data + start_line*line_stride, 1, NUM_SAMPLES, line_stride, &coarse, chunked + start_line, NULL, &state, num_next_lines);
+		}
+		masking_coarse_state_free(&state);
+
+		TEST_CHECK(chunked_classified == whole_classified);
+		TEST_CHECK(same_thresh(&mask_param, chunked, whole, NUM_SAMPLES, NUM_LINES));
+		TEST_CHECK(same_updated_spectra(&chunked_param, &whole_param));
+		free_image_thresh(chunked, NUM_SAMPLES, NUM_LINES);
+		masking_free(&chunked_param);
+	}
+
+	free_image_thresh(whole, NUM_SAMPLES, NUM_LINES);
+	masking_free(&whole_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * A label change between block rows should refine the blocks on both sides. The center pixel of the first block row does not match while 
+ * the rest of the image does, so that the first block row is only correct if it is refined because of the block row below it. 
+ **/
+void test_coarse_refines_both_sides(){
+	masking_t mask_param;
+	test_masking_init(1, NUM_BANDS, 1, 0.3, 7, &mask_param);
+	const int num_samples = 4;
+	const int num_lines = 8;
+	float *data = new float[num_lines*NUM_BANDS*num_samples];
+	unsigned int seed = 8;
+	for (int i=0; i < num_lines; i++){
+		for (int j=0; j < num_samples; j++){
+			for (int b=0; b < NUM_BANDS; b++){
+				//noisy reference spectrum, or its mirror image, far from it
+				float val = mask_param.orig_spectra[0][b]*(1 + 0.05f*(test_random(&seed) - 0.5f));
+				if ((i == 1) && (j == 1)){
+					val = 1.5f - mask_param.orig_spectra[0][b];
+				}
+				data[(i*NUM_BANDS + b)*num_samples + j] = val;
+			}
+		}
+	}
+
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, num_samples, num_lines);
+	mask_image_reference(&reference_param, data, num_samples, num_lines, reference);
+	TEST_CHECK(!reference[1][1][0] && reference[0][0][0]);
+
+	masking_coarse_t coarse = {num_samples, 0.0f};
+	mask_thresh_t *thresh = allocate_image_thresh(&mask_param, num_samples, num_lines);
+	masking_thresh_coarse_to_fine(&mask_param, num_samples, num_lines, data, 1, num_samples, NUM_BANDS*num_samples, &coarse, thresh, NULL, NULL, 0);
+	TEST_CHECK(same_thresh(&mask_param, thresh, reference, num_samples, num_lines));
+
+	free_image_thresh(thresh, num_samples, num_lines);
+	free_image_thresh(reference, num_samples, num_lines);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * Masking with the index over the reference spectra should give the same results as the brute-force SAM over all reference spectra, 
+ * also while the updated spectra drift. 
+ **/
+void test_index_exact(){
+	const int num_spectra = 96;
+	masking_t mask_param;
+	test_masking_init(num_spectra, NUM_BANDS, 8, 0.2, 9, &mask_param);
+	TEST_CHECK(mask_param.index != NULL);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 10);
+
+	masking_t brute_force_param;
+	masking_copy(&brute_force_param, &mask_param);
+	masking_index_free(brute_force_param.index);
+	brute_force_param.index = NULL;
+
+	//start from updated spectra replaced by merging a state, which the index bounds should also cover
+	masking_t state;
+	masking_copy(&state, &brute_force_param);
+	float *state_data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 11);
+	mask_lines(&state, state_data, 0, NUM_LINES);
+	masking_merge_state(&mask_param, 1, &state);
+	masking_merge_state(&brute_force_param, 1, &state);
+	masking_free(&state);
+	delete [] state_data;
+
+	//thresholds only, where reference spectra are pruned, and with SAM outputs
+	for (int with_output=0; with_output < 2; with_output++){
+		mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+		mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+		vector<float> min_angle(NUM_SAMPLES), reference_min_angle(NUM_SAMPLES);
+		vector<unsigned short> best_reference(NUM_SAMPLES), reference_best_reference(NUM_SAMPLES);
+		masking_output_t output = {NULL, &min_angle[0], &best_reference[0]};
+		masking_output_t reference_output = {NULL, &reference_min_angle[0], &reference_best_reference[0]};
+		for (int i=0; i < NUM_LINES; i++){
+			const float *line_data = data + (long)i*NUM_BANDS*NUM_SAMPLES;
+			masking_thresh_output(&mask_param, NUM_SAMPLES, line_data, 1, NUM_SAMPLES, &thresh[i], with_output ? &output : NULL);
+			masking_thresh_output(&brute_force_param, NUM_SAMPLES, line_data, 1, NUM_SAMPLES, &reference[i], with_output ? &reference_output : NULL);
+			if (with_output){
+				for (int j=0; j < NUM_SAMPLES; j++){
+					TEST_CHECK(best_reference[j] == reference_best_reference[j]);
+					TEST_CHECK(min_angle[j] == reference_min_angle[j]);
+				}
+			}
+		}
+		TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+		TEST_CHECK(same_updated_spectra(&mask_param, &brute_force_param));
+		free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+		free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	}
+
+	masking_free(&brute_force_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * Masking with the pre-filter should give the same results as masking without it, and reject pixels far from all reference spectra. 
+ **/
+void test_prefilter_exact(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 11, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 12);
+
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_image_reference(&reference_param, data, NUM_SAMPLES, NUM_LINES, reference);
+
+	int num_groups[3] = {1, 4, 16};
+	long num_rejected[3];
+	for (int g=0; g < 3; g++){
+		masking_t prefilter_param;
+		masking_copy(&prefilter_param, &mask_param);
+		masking_set_prefilter(&prefilter_param, num_groups[g]);
+		TEST_CHECK(prefilter_param.prefilter != NULL);
+		mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+		mask_image_reference(&prefilter_param, data, NUM_SAMPLES, NUM_LINES, thresh);
+
+		TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+		TEST_CHECK(same_updated_spectra(&prefilter_param, &reference_param));
+		masking_prefilter_stats_t stats;
+		masking_get_prefilter_stats(&prefilter_param, &stats);
+		TEST_CHECK(stats.num_tested == NUM_SAMPLES*NUM_LINES);
+		num_rejected[g] = stats.num_rejected;
+
+		free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+		masking_free(&prefilter_param);
+	}
+
+	//the random spectra need many band groups before the bound rejects the unrelated pixels
+	TEST_CHECK(num_rejected[2] > 0);
+
+	//disabled by default
+	masking_prefilter_stats_t stats;
+	masking_get_prefilter_stats(&reference_param, &stats);
+	TEST_CHECK(reference_param.prefilter == NULL);
+	TEST_CHECK((stats.num_tested == 0) && (stats.num_rejected == 0));
+
+	free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * The degradation level should be raised after each line over the target, and lowered again only after the backlog is cleared and a run of fast lines. 
+ **/
+void test_budget_levels(){
+	const double target = 1.0e-3;
+	masking_budget_t budget;
+	masking_budget_init(&budget, target);
+	TEST_CHECK(budget.level == MASKING_BUDGET_FULL);
+
+	//lines within the target keep the level, also with backlog from earlier lines
+	masking_budget_record(&budget, 0.9*target);
+	TEST_CHECK(budget.level == MASKING_BUDGET_FULL);
+	masking_budget_record(&budget, 3*target);
+	TEST_CHECK(budget.level == MASKING_BUDGET_DEFERRED_UPDATES);
+	masking_budget_record(&budget, 0.9*target);
+	TEST_CHECK((budget.level == MASKING_BUDGET_DEFERRED_UPDATES) && (budget.backlog > 0));
+
+	//each line over the target raises the level, up to classification only
+	for (int i=2; i <= MASKING_BUDGET_NUM_LEVELS; i++){
+		masking_budget_record(&budget, 3*target);
+		TEST_CHECK(budget.level == min(i, (int)MASKING_BUDGET_CLASSIFY_ONLY));
+	}
+	TEST_CHECK(budget.backlog > 0);
+
+	//fast lines only count once the backlog has been caught up
+	int num_catch_up_lines = 0;
+	while (budget.backlog > 0){
+		masking_budget_record(&budget, 0.1*target);
+		TEST_CHECK(budget.level == MASKING_BUDGET_CLASSIFY_ONLY);
+		num_catch_up_lines++;
+	}
+	TEST_CHECK(num_catch_up_lines > 1);
+
+	//fast lines lower the level by one after each run, counted from the line that cleared the backlog
+	int num_lines = 0;
+	while ((budget.level == MASKING_BUDGET_CLASSIFY_ONLY) && (num_lines < 1000)){
+		masking_budget_record(&budget, 0.1*target);
+		num_lines++;
+	}
+	TEST_CHECK(budget.level == MASKING_BUDGET_SUBSAMPLED_UPDATES);
+	int run_length = 0;
+	while ((budget.level == MASKING_BUDGET_SUBSAMPLED_UPDATES) && (run_length < 1000)){
+		masking_budget_record(&budget, 0.1*target);
+		run_length++;
+	}
+	TEST_CHECK(run_length > 1);
+	TEST_CHECK(budget.level == MASKING_BUDGET_DEFERRED_UPDATES);
+
+	//a line slower than the fast fraction, but within the target, restarts the run
+	for (int i=0; i < run_length - 1; i++){
+		masking_budget_record(&budget, 0.1*target);
+	}
+	masking_budget_record(&budget, 0.9*target);
+	masking_budget_record(&budget, 0.1*target);
+	TEST_CHECK(budget.level == MASKING_BUDGET_DEFERRED_UPDATES);
+	for (int i=0; i < run_length - 1; i++){
+		masking_budget_record(&budget, 0.1*target);
+	}
+	TEST_CHECK(budget.level == MASKING_BUDGET_FULL);
+
+	//a line over the target raises the level again
+	masking_budget_record(&budget, 1.5*target);
+	TEST_CHECK(budget.level == MASKING_BUDGET_DEFERRED_UPDATES);
+
+	masking_budget_stats_t stats;
+	masking_get_budget_stats(&budget, &stats);
+	long num_counted = 0;
+	for (int i=0; i < MASKING_BUDGET_NUM_LEVELS; i++){
+		num_counted += stats.level_count[i];
+	}
+	TEST_CHECK((stats.num_lines == num_counted) && (num_counted == budget.num_lines));
+	TEST_CHECK(stats.level_count[MASKING_BUDGET_FULL] == 3);
+	TEST_CHECK(stats.max == 3*target);
+	TEST_CHECK((stats.p50 >= 0.1*target) && (stats.p50 <= 0.11*target));
+}
+
+/**
+ * Latency budget mode at full adaptation should give the same results as masking_thresh_output(), and classification only should leave 
+ * the updated spectra unchanged. 
+ **/
+void test_budget_results(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 13, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 14);
+
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_image_reference(&reference_param, data, NUM_SAMPLES, NUM_LINES, reference);
+
+	int levels[2] = {MASKING_BUDGET_FULL, MASKING_BUDGET_CLASSIFY_ONLY};
+	for (int l=0; l < 2; l++){
+		masking_t budget_param;
+		masking_copy(&budget_param, &mask_param);
+		mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+		masking_budget_t budget;
+		masking_budget_init(&budget, 1.0e3);
+		for (int i=0; i < NUM_LINES; i++){
+			budget.level = levels[l];
+			masking_thresh_budget(&budget_param, &budget, NUM_SAMPLES, data + (long)i*NUM_BANDS*NUM_SAMPLES, 1, NUM_SAMPLES, &thresh[i], NULL);
+		}
+		TEST_CHECK(budget.level_count[levels[l]] == NUM_LINES);
+		if (levels[l] == MASKING_BUDGET_FULL){
+			TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+			TEST_CHECK(same_updated_spectra(&budget_param, &reference_param));
+		} else {
+			TEST_CHECK(same_updated_spectra(&budget_param, &mask_param));
+		}
+		free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+		masking_free(&budget_param);
+	}
+
+	free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * Mask all lines of an image view using masking_thresh_strided(). 
+ **/
+void mask_view(masking_t *mask_param, const masking::image_view &view, mask_thresh_t *thresh){
+	for (int i=0; i < view.lines; i++){
+		masking_thresh_strided(mask_param, view.samples, view.line(i), view.sample_stride, view.band_stride, &thresh[i]);
+	}
+}
+
+/**
+ * Strided masking of BIP and BSQ data and of sub-windows should give the same results as masking_thresh() on contiguous BIL lines. 
+ **/
+void test_strided_layouts(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 15, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 16);
+
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	for (int i=0; i < NUM_LINES; i++){
+		masking_thresh(&reference_param, NUM_SAMPLES, data + (long)i*NUM_BANDS*NUM_SAMPLES, &reference[i]);
+	}
+
+	//same image in the other layouts
+	long num_values = (long)NUM_LINES*NUM_BANDS*NUM_SAMPLES;
+	vector<float> bip_data(num_values), bsq_data(num_values);
+	masking::image_view bil = masking::image_view::bil(data, NUM_SAMPLES, NUM_BANDS, NUM_LINES);
+	masking::image_view bip = masking::image_view::bip(&bip_data[0], NUM_SAMPLES, NUM_BANDS, NUM_LINES);
+	masking::image_view bsq = masking::image_view::bsq(&bsq_data[0], NUM_SAMPLES, NUM_BANDS, NUM_LINES);
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			for (int b=0; b < NUM_BANDS; b++){
+				float val = bil.line(i)[j*bil.sample_stride + b*bil.band_stride];
+				bip_data[i*bip.line_stride + j*bip.sample_stride + b*bip.band_stride] = val;
+				bsq_data[i*bsq.line_stride + j*bsq.sample_stride + b*bsq.band_stride] = val;
+			}
+		}
+	}
+	masking::image_view views[3] = {bil, bip, bsq};
+	for (int v=0; v < 3; v++){
+		masking_t view_param;
+		masking_copy(&view_param, &mask_param);
+		mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+		mask_view(&view_param, views[v], thresh);
+		TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+		TEST_CHECK(same_updated_spectra(&view_param, &reference_param));
+		free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+		masking_free(&view_param);
+	}
+
+	//sub-window of the BIP data against a contiguous BIL copy of the window
+	const int start_line = 3, num_lines = 10, start_sample = 7, num_samples = 30;
+	vector<float> window_data((long)num_lines*NUM_BANDS*num_samples);
+	for (int i=0; i < num_lines; i++){
+		for (int b=0; b < NUM_BANDS; b++){
+			for (int j=0; j < num_samples; j++){
+				window_data[((long)i*NUM_BANDS + b)*num_samples + j] = bil.line(start_line + i)[(start_sample + j) + b*bil.band_stride];
+			}
+		}
+	}
+	masking_t window_reference_param, window_param;
+	masking_copy(&window_reference_param, &mask_param);
+	masking_copy(&window_param, &mask_param);
+	mask_thresh_t *window_reference = allocate_image_thresh(&mask_param, num_samples, num_lines);
+	mask_thresh_t *window_thresh = allocate_image_thresh(&mask_param, num_samples, num_lines);
+	for (int i=0; i < num_lines; i++){
+		masking_thresh(&window_reference_param, num_samples, &window_data[(long)i*NUM_BANDS*num_samples], &window_reference[i]);
+	}
+	mask_view(&window_param, bip.window(start_line, num_lines, start_sample, num_samples, 0, NUM_BANDS), window_thresh);
+	TEST_CHECK(same_thresh(&mask_param, window_thresh, window_reference, num_samples, num_lines));
+	TEST_CHECK(same_updated_spectra(&window_param, &window_reference_param));
+	free_image_thresh(window_thresh, num_samples, num_lines);
+	free_image_thresh(window_reference, num_samples, num_lines);
+	masking_free(&window_param);
+	masking_free(&window_reference_param);
+
+	free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * SAM angle between pixel and reference spectrum, calculated in double precision. 
+ **/
+double sam_angle(const float *pixel, long band_stride, const float *reference){
+	double dot = 0, pixel_norm = 0, reference_norm = 0;
+	for (int i=0; i < NUM_BANDS; i++){
+		dot += pixel[i*band_stride]*(double)reference[i];
+		pixel_norm += pixel[i*band_stride]*(double)pixel[i*band_stride];
+		reference_norm += reference[i]*(double)reference[i];
+	}
+	return acos(min(1.0, dot/sqrt(pixel_norm*reference_norm)));
+}
+
+/**
+ * The fused outputs of masking_thresh_output() should equal the mask from masking_pixel_belongs() and brute-force minimum SAM angles, 
+ * without changing the thresholded values. 
+ **/
+void test_fused_outputs(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 17, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 18);
+
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_image_reference(&reference_param, data, NUM_SAMPLES, NUM_LINES, reference);
+
+	//pixel by pixel, so that the angles can be calculated against the updated spectra seen by each pixel
+	mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_thresh_t pixel_thresh = masking_allocate_thresh(&mask_param, 1);
+	long num_near_ties = 0;
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			const float *pixel = data + (long)i*NUM_BANDS*NUM_SAMPLES + j;
+			double best_angle = 10, second_angle = 10;
+			int best_reference = -1;
+			for (int k=0; k < NUM_SPECTRA; k++){
+				double angle = min(sam_angle(pixel, NUM_SAMPLES, mask_param.orig_spectra[k]), sam_angle(pixel, NUM_SAMPLES, mask_param.updated_spectra[k]));
+				if (angle < best_angle){
+					second_angle = best_angle;
+					best_angle = angle;
+					best_reference = k;
+				} else if (angle < second_angle){
+					second_angle = angle;
+				}
+			}
+
+			unsigned char mask;
+			float min_angle;
+			unsigned short best;
+			masking_output_t output = {&mask, &min_angle, &best};
+			masking_thresh_output(&mask_param, 1, pixel, 1, NUM_SAMPLES, &pixel_thresh, &output);
+			for (int k=0; k < NUM_SPECTRA; k++){
+				thresh[i][j][k] = pixel_thresh[0][k];
+			}
+			TEST_CHECK(mask == masking_pixel_belongs(&mask_param, pixel_thresh, 0));
+			//compare cosines, the float acos is imprecise for small angles
+			TEST_CHECK(fabs(cos(min_angle) - cos(best_angle)) < 1.0e-5);
+			if (cos(best_angle) - cos(second_angle) > 1.0e-5){
+				TEST_CHECK(best == best_reference);
+			} else {
+				num_near_ties++;
+			}
+		}
+	}
+	TEST_CHECK(num_near_ties < NUM_SAMPLES);
+	TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+	TEST_CHECK(same_updated_spectra(&mask_param, &reference_param));
+
+	masking_free_thresh(&pixel_thresh, 1);
+	free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+	free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+/**
+ * Batch classification of single pixels updates no reference spectra within a block, and should give the same results as masking_thresh_output(). 
+ * For a whole block, the updated spectra should afterwards be the running means over the pixels thresholded against the spectra held fixed. 
+ **/
+void test_batch(){
+	masking_t mask_param;
+	test_masking_init(NUM_SPECTRA, NUM_BANDS, 4, 0.3, 19, &mask_param);
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 20);
+
+	masking_t reference_param;
+	masking_copy(&reference_param, &mask_param);
+	mask_thresh_t *reference = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_image_reference(&reference_param, data, NUM_SAMPLES, NUM_LINES, reference);
+
+	//one pixel per block, gathered into its own BIL line
+	masking_t pixel_param;
+	masking_copy(&pixel_param, &mask_param);
+	mask_thresh_t *thresh = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	mask_thresh_t pixel_thresh = masking_allocate_thresh(&mask_param, 1);
+	vector<float> pixel(NUM_BANDS);
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			for (int b=0; b < NUM_BANDS; b++){
+				pixel[b] = data[((long)i*NUM_BANDS + b)*NUM_SAMPLES + j];
+			}
+			masking_thresh_batch(&pixel_param, 1, 1, &pixel[0], &pixel_thresh, NULL);
+			for (int k=0; k < NUM_SPECTRA; k++){
+				thresh[i][j][k] = pixel_thresh[0][k];
+			}
+		}
+	}
+	TEST_CHECK(same_thresh(&mask_param, thresh, reference, NUM_SAMPLES, NUM_LINES));
+	for (int k=0; k < NUM_SPECTRA; k++){
+		TEST_CHECK(pixel_param.num_samples_in_spectra[k] == reference_param.num_samples_in_spectra[k]);
+		for (int b=0; b < NUM_BANDS; b++){
+			TEST_CHECK(test_close(pixel_param.updated_spectra[k][b], reference_param.updated_spectra[k][b], 1e-5));
+		}
+	}
+	masking_free_thresh(&pixel_thresh, 1);
+	masking_free(&pixel_param);
+
+	//whole image as one block, against the masks of the line-by-line classification with updates disabled
+	masking_t block_param;
+	masking_copy(&block_param, &mask_param);
+	masking_t fixed_param;
+	masking_copy(&fixed_param, &mask_param);
+	masking_budget_t budget;
+	masking_budget_init(&budget, 1.0e3);
+	mask_thresh_t *fixed = allocate_image_thresh(&mask_param, NUM_SAMPLES, NUM_LINES);
+	for (int i=0; i < NUM_LINES; i++){
+		budget.level = MASKING_BUDGET_CLASSIFY_ONLY;
+		masking_thresh_budget(&fixed_param, &budget, NUM_SAMPLES, data + (long)i*NUM_BANDS*NUM_SAMPLES, 1, NUM_SAMPLES, &fixed[i], NULL);
+	}
+	masking_thresh_batch(&block_param, NUM_SAMPLES, NUM_LINES, data, thresh, NULL);
+	vector<double> sums(NUM_SPECTRA*NUM_BANDS);
+	vector<long> counts(NUM_SPECTRA);
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			for (int k=0; k < NUM_SPECTRA; k++){
+				//classification only compares against the original spectra, which equal the updated spectra at the start
+				TEST_CHECK(thresh[i][j][k] == fixed[i][j][k]);
+				if (!thresh[i][j][k]){
+					continue;
+				}
+				counts[k]++;
+				for (int b=0; b < NUM_BANDS; b++){
+					sums[k*NUM_BANDS + b] += data[((long)i*NUM_BANDS + b)*NUM_SAMPLES + j];
+				}
+			}
+		}
+	}
+	for (int k=0; k < NUM_SPECTRA; k++){
+		TEST_CHECK(block_param.num_samples_in_spectra[k] == counts[k]);
+		for (int b=0; b < NUM_BANDS; b++){
+			double expected = (counts[k] > 0) ? sums[k*NUM_BANDS + b]/counts[k] : mask_param.updated_spectra[k][b];
+			TEST_CHECK(test_close(block_param.updated_spectra[k][b], expected, 1e-4));
+		}
+	}
+	free_image_thresh(fixed, NUM_SAMPLES, NUM_LINES);
+	masking_free(&fixed_param);
+	masking_free(&block_param);
+
+	free_image_thresh(thresh, NUM_SAMPLES, NUM_LINES);
+	free_image_thresh(reference, NUM_SAMPLES, NUM_LINES);
+	masking_free(&reference_param);
+	masking_free(&mask_param);
+	delete [] data;
+}
+
+int main(){
+	test_merge_state();
+	test_strided_layouts();
+	test_fused_outputs();
+	test_coarse_single_pixel_blocks();
+	test_coarse_chunked();
+	test_coarse_refines_both_sides();
+	test_index_exact();
+	test_batch();
+	test_prefilter_exact();
+	test_budget_levels();
+	test_budget_results();
+	return test_report("test_masking");
+}
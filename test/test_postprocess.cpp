@@ -0,0 +1,254 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "test_common.h"
+#include "postprocess.h"
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#define NUM_SAMPLES 37
+#define NUM_LINES 29
+
+typedef vector<vector<unsigned char> > test_mask_t;
+
+/**
+ * Random mask with the given fraction of set pixels.
+ **/
+test_mask_t random_mask(float fraction, unsigned int seed){
+	test_mask_t mask(NUM_LINES, vector<unsigned char>(NUM_SAMPLES));
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			mask[i][j] = test_random(&seed) < fraction;
+		}
+	}
+	return mask;
+}
+
+/**
+ * Brute-force morphological operation over the whole mask, ignoring pixels outside the image.
+ **/
+test_mask_t morphology_reference(const test_mask_t &mask, morphology_op_t op, int radius){
+	test_mask_t ret(NUM_LINES, vector<unsigned char>(NUM_SAMPLES));
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			bool all_set = true;
+			bool any_set = false;
+			for (int y=max(i - radius, 0); y <= min(i + radius, NUM_LINES - 1); y++){
+				for (int x=max(j - radius, 0); x <= min(j + radius, NUM_SAMPLES - 1); x++){
+					all_set = all_set && mask[y][x];
+					any_set = any_set || mask[y][x];
+				}
+			}
+			ret[i][j] = (op == MORPHOLOGY_ERODE) ? all_set : any_set;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Brute-force connected regions (8-connectivity) by flood fill, sorted.
+ **/
+vector<mask_region_t> regions_reference(const test_mask_t &mask){
+	vector<vector<bool> > visited(NUM_LINES, vector<bool>(NUM_SAMPLES));
+	vector<mask_region_t> regions;
+	for (int i=0; i < NUM_LINES; i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			if (!mask[i][j] || visited[i][j]){
+				continue;
+			}
+			mask_region_t region = {0, i, i, j, j};
+			vector<pair<int, int> > stack(1, make_pair(i, j));
+			visited[i][j] = true;
+			while (!stack.empty()){
+				int y = stack.back().first;
+				int x = stack.back().second;
+				stack.pop_back();
+				region.area++;
+				region.start_line = min(region.start_line, (long)y);
+				region.end_line = max(region.end_line, (long)y);
+				region.start_sample = min(region.start_sample, x);
+				region.end_sample = max(region.end_sample, x);
+				for (int dy=-1; dy <= 1; dy++){
+					for (int dx=-1; dx <= 1; dx++){
+						int ny = y + dy;
+						int nx = x + dx;
+						if ((ny >= 0) && (ny < NUM_LINES) && (nx >= 0) && (nx < NUM_SAMPLES) && mask[ny][nx] && !visited[ny][nx]){
+							visited[ny][nx] = true;
+							stack.push_back(make_pair(ny, nx));
+						}
+					}
+				}
+			}
+			regions.push_back(region);
+		}
+	}
+	return regions;
+}
+
+bool region_less(const mask_region_t &a, const mask_region_t &b){
+	if (a.start_line != b.start_line) return a.start_line < b.start_line;
+	if (a.start_sample != b.start_sample) return a.start_sample < b.start_sample;
+	if (a.end_line != b.end_line) return a.end_line < b.end_line;
+	if (a.end_sample != b.end_sample) return a.end_sample < b.end_sample;
+	return a.area < b.area;
+}
+
+bool region_equal(const mask_region_t &a, const mask_region_t &b){
+	return (a.area == b.area) && (a.start_line == b.start_line) && (a.end_line == b.end_line) && (a.start_sample == b.start_sample) && (a.end_sample == b.end_sample);
+}
+
+/**
+ * Compare regions reported by the labeler with the brute-force regions.
+ **/
+void check_regions(vector<mask_region_t> regions, const test_mask_t &mask){
+	vector<mask_region_t> expected = regions_reference(mask);
+	sort(regions.begin(), regions.end(), region_less);
+	sort(expected.begin(), expected.end(), region_less);
+	TEST_CHECK(regions.size() == expected.size());
+	for (int i=0; i < (int)min(regions.size(), expected.size()); i++){
+		TEST_CHECK(region_equal(regions[i], expected[i]));
+	}
+}
+
+/**
+ * Streaming morphological filter should equal the brute-force operation, with the output lagging radius lines.
+ **/
+void test_morphology(){
+	test_mask_t mask = random_mask(0.6, 1);
+	morphology_op_t ops[2] = {MORPHOLOGY_ERODE, MORPHOLOGY_DILATE};
+	for (int o=0; o < 2; o++){
+		for (int radius=1; radius <= 3; radius++){
+			test_mask_t expected = morphology_reference(mask, ops[o], radius);
+			morphology_filter_t filter;
+			morphology_init(&filter, ops[o], NUM_SAMPLES, radius);
+			test_mask_t output;
+			vector<unsigned char> line(NUM_SAMPLES);
+			for (int i=0; i < NUM_LINES; i++){
+				if (morphology_push_line(&filter, &mask[i][0], &line[0])){
+					output.push_back(line);
+					TEST_CHECK((int)output.size() == i - radius + 1);
+				}
+			}
+			while (morphology_flush_line(&filter, &line[0])){
+				output.push_back(line);
+			}
+			morphology_free(&filter);
+			TEST_CHECK(output == expected);
+		}
+	}
+}
+
+/**
+ * Labeler should report the same regions as a flood fill.
+ **/
+void test_labeling(){
+	float fractions[3] = {0.2, 0.5, 0.8};
+	for (int f=0; f < 3; f++){
+		test_mask_t mask = random_mask(fractions[f], 10 + f);
+		mask_labeler_t labeler;
+		mask_labeler_init(&labeler, NUM_SAMPLES);
+		vector<mask_region_t> regions;
+		mask_region_t region;
+		for (int i=0; i < NUM_LINES; i++){
+			mask_labeler_push_line(&labeler, &mask[i][0]);
+			while (mask_labeler_pop_region(&labeler, &region)){
+				//completed regions are reported as soon as they end
+				TEST_CHECK(region.end_line < i);
+				regions.push_back(region);
+			}
+		}
+		mask_labeler_finish(&labeler);
+		while (mask_labeler_pop_region(&labeler, &region)){
+			regions.push_back(region);
+		}
+		mask_labeler_free(&labeler);
+		check_regions(regions, mask);
+	}
+
+	//U-shaped region whose arms are first labeled separately
+	test_mask_t mask(NUM_LINES, vector<unsigned char>(NUM_SAMPLES));
+	for (int i=2; i < 10; i++){
+		mask[i][3] = mask[i][12] = 1;
+	}
+	for (int j=3; j <= 12; j++){
+		mask[10][j] = 1;
+	}
+	mask_labeler_t labeler;
+	mask_labeler_init(&labeler, NUM_SAMPLES);
+	for (int i=0; i < NUM_LINES; i++){
+		mask_labeler_push_line(&labeler, &mask[i][0]);
+	}
+	mask_labeler_finish(&labeler);
+	vector<mask_region_t> regions;
+	mask_region_t region;
+	while (mask_labeler_pop_region(&labeler, &region)){
+		regions.push_back(region);
+	}
+	mask_labeler_free(&labeler);
+	TEST_CHECK(regions.size() == 1);
+	check_regions(regions, mask);
+}
+
+/**
+ * Post-processing should equal brute-force opening followed by closing, and label the cleaned mask.
+ **/
+void test_postprocess(){
+	test_mask_t mask = random_mask(0.55, 20);
+
+	//isolated pixel removed by opening, hole in a square filled by closing
+	for (int i=0; i < 3; i++){
+		for (int j=0; j < 3; j++){
+			mask[i][j] = 0;
+		}
+	}
+	mask[1][1] = 1;
+	for (int i=15; i < 25; i++){
+		for (int j=20; j < 30; j++){
+			mask[i][j] = !((i == 20) && (j == 25));
+		}
+	}
+
+	int opening_radius = 1;
+	int closing_radius = 1;
+	test_mask_t expected = morphology_reference(morphology_reference(mask, MORPHOLOGY_ERODE, opening_radius), MORPHOLOGY_DILATE, opening_radius);
+	expected = morphology_reference(morphology_reference(expected, MORPHOLOGY_DILATE, closing_radius), MORPHOLOGY_ERODE, closing_radius);
+	TEST_CHECK(!expected[1][1]);
+	TEST_CHECK(expected[20][25]);
+
+	mask_postprocess_t postprocess;
+	mask_postprocess_init(&postprocess, NUM_SAMPLES, opening_radius, closing_radius);
+	test_mask_t output;
+	vector<mask_region_t> regions;
+	vector<unsigned char> line(NUM_SAMPLES);
+	mask_region_t region;
+	for (int i=0; i < NUM_LINES; i++){
+		mask_postprocess_push_line(&postprocess, &mask[i][0]);
+		while (mask_postprocess_pop_line(&postprocess, &line[0])){
+			output.push_back(line);
+		}
+		TEST_CHECK((int)output.size() == max(0, i + 1 - 2*(opening_radius + closing_radius)));
+	}
+	mask_postprocess_finish(&postprocess);
+	while (mask_postprocess_pop_line(&postprocess, &line[0])){
+		output.push_back(line);
+	}
+	while (mask_postprocess_pop_region(&postprocess, &region)){
+		regions.push_back(region);
+	}
+	mask_postprocess_free(&postprocess);
+
+	TEST_CHECK(output == expected);
+	check_regions(regions, expected);
+}
+
+int main(){
+	test_morphology();
+	test_labeling();
+	test_postprocess();
+	return test_report("test_postprocess");
+}
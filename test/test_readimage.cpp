@@ -0,0 +1,382 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "test_common.h"
+#include "readimage.h"
+#include <vector>
+#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+using namespace std;
+
+#define NUM_SAMPLES 9
+#define NUM_LINES 12
+#define NUM_BANDS 7
+
+/**
+ * Value of each element of the test images.
+ **/
+float test_value(int line, int band, int sample){
+	return line*100 + band*10 + sample;
+}
+
+/**
+ * Write header of the test image, with header offset.
+ **/
+void write_test_header(const char *basename, int datatype, off_t offset){
+	string hdrName = string(basename) + ".hdr";
+	FILE *fp = fopen(hdrName.c_str(), "wt");
+	fprintf(fp, "ENVI\nsamples = %d\nlines = %d\nbands = %d\nheader offset = %lld\nfile type = ENVI Standard\n", NUM_SAMPLES, NUM_LINES, NUM_BANDS, (long long)offset);
+	fprintf(fp, "data type = %d\ninterleave = bil\nbyte order = 0\nwavelength = {", datatype);
+	for (int i=0; i < NUM_BANDS; i++){
+		fprintf(fp, "%d ", 400 + 10*i);
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+}
+
+/**
+ * BIL image data of the test image in the given datatype, 2 (16-bit integer) or 4 (float).
+ **/
+vector<char> test_image_data(int datatype){
+	size_t elementBytes = (datatype == 2) ? sizeof(short) : sizeof(float);
+	vector<char> data(elementBytes*NUM_LINES*NUM_BANDS*NUM_SAMPLES);
+	for (int i=0; i < NUM_LINES; i++){
+		for (int b=0; b < NUM_BANDS; b++){
+			for (int j=0; j < NUM_SAMPLES; j++){
+				size_t position = ((size_t)i*NUM_BANDS + b)*NUM_SAMPLES + j;
+				if (datatype == 2){
+					short value = test_value(i, b, j);
+					memcpy(&data[position*elementBytes], &value, elementBytes);
+				} else {
+					float value = test_value(i, b, j);
+					memcpy(&data[position*elementBytes], &value, elementBytes);
+				}
+			}
+		}
+	}
+	return data;
+}
+
+/**
+ * Write uncompressed test image, preceded by offset bytes. Large offsets leave a hole in the file.
+ * \return True if the image could be written
+ **/
+bool write_test_image(const char *filename, int datatype, off_t offset){
+	vector<char> data = test_image_data(datatype);
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0){
+		return false;
+	}
+	vector<char> headerBytes(min(offset, (off_t)4096), 'x');
+	bool written = (pwrite(fd, &headerBytes[0], headerBytes.size(), 0) == (ssize_t)headerBytes.size());
+	written = written && (pwrite(fd, &data[0], data.size(), offset) == (ssize_t)data.size());
+	close(fd);
+	return written;
+}
+
+/**
+ * Check that the subset read using hyperspectral_read_image() has the expected values.
+ **/
+void check_read_image(const char *filename, HyspexHeader *header){
+	ImageSubset subset = {2, 8, 3, 11, 1, 6};
+	int subsetSamples = subset.endSamp - subset.startSamp;
+	int subsetBands = subset.endBand - subset.startBand;
+	int subsetLines = subset.endLine - subset.startLine;
+	vector<float> data(subsetSamples*subsetBands*subsetLines);
+	hyperspectral_read_image((char*)filename, header, subset, &data[0]);
+	bool equal = true;
+	for (int i=0; i < subsetLines; i++){
+		for (int b=0; b < subsetBands; b++){
+			for (int j=0; j < subsetSamples; j++){
+				equal = equal && (data[(i*subsetBands + b)*subsetSamples + j] == test_value(subset.startLine + i, subset.startBand + b, subset.startSamp + j));
+			}
+		}
+	}
+	TEST_CHECK(equal);
+}
+
+/**
+ * Whether the lines read using the sequential reader are the expected lines of the test image.
+ **/
+bool same_lines(const float *data, int startLine, int numLines){
+	for (int i=0; i < numLines; i++){
+		for (int b=0; b < NUM_BANDS; b++){
+			for (int j=0; j < NUM_SAMPLES; j++){
+				if (data[(i*NUM_BANDS + b)*NUM_SAMPLES + j] != test_value(startLine + i, b, j)){
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Check sequential reading from a start line, with peeking ahead.
+ **/
+void check_reader(const char *filename, HyspexHeader *header){
+	const int startLine = 3;
+	vector<float> data(NUM_LINES*NUM_BANDS*NUM_SAMPLES);
+	HyspexReader reader;
+	TEST_CHECK(hyperspectral_try_reader_open(&reader, filename, header, startLine) == HYPERSPECTRAL_NO_ERR);
+
+	//peeked lines are read again
+	TEST_CHECK(hyperspectral_reader_peek_lines(&reader, 2, &data[0]) == 2);
+	TEST_CHECK(same_lines(&data[0], startLine, 2));
+	TEST_CHECK(hyperspectral_reader_read_lines(&reader, 1, &data[0]) == 1);
+	TEST_CHECK(same_lines(&data[0], startLine, 1));
+	TEST_CHECK(hyperspectral_reader_peek_lines(&reader, 3, &data[0]) == 3);
+	TEST_CHECK(same_lines(&data[0], startLine + 1, 3));
+	TEST_CHECK(hyperspectral_reader_read_lines(&reader, 2, &data[0]) == 2);
+	TEST_CHECK(same_lines(&data[0], startLine + 1, 2));
+
+	//short read at the end of the image, also when peeking past it
+	int numRemaining = NUM_LINES - startLine - 3;
+	TEST_CHECK(hyperspectral_reader_peek_lines(&reader, NUM_LINES, &data[0]) == numRemaining);
+	TEST_CHECK(hyperspectral_reader_read_lines(&reader, NUM_LINES, &data[0]) == numRemaining);
+	TEST_CHECK(same_lines(&data[0], startLine + 3, numRemaining));
+	TEST_CHECK(hyperspectral_reader_read_lines(&reader, 1, &data[0]) == 0);
+	TEST_CHECK(reader.linesRead == NUM_LINES - startLine);
+	hyperspectral_reader_close(&reader);
+}
+
+/**
+ * Read uncompressed images with header offset using both the direct and the sequential reader.
+ **/
+void test_read_uncompressed(){
+	int datatypes[2] = {2, 4};
+	for (int d=0; d < 2; d++){
+		const char *filename = "test_readimage.img";
+		off_t offset = 123;
+		write_test_header("test_readimage", datatypes[d], offset);
+		TEST_CHECK(write_test_image(filename, datatypes[d], offset));
+
+		HyspexHeader header;
+		TEST_CHECK(hyperspectral_try_read_header(filename, &header) == HYPERSPECTRAL_NO_ERR);
+		TEST_CHECK((header.samples == NUM_SAMPLES) && (header.lines == NUM_LINES) && (header.bands == NUM_BANDS));
+		TEST_CHECK((header.offset == offset) && (header.datatype == datatypes[d]));
+		TEST_CHECK((header.wlens.size() == NUM_BANDS) && (header.wlens[1] == 410));
+
+		check_read_image(filename, &header);
+		check_reader(filename, &header);
+		unlink(filename);
+		unlink("test_readimage.hdr");
+	}
+}
+
+/**
+ * Header offsets and line positions beyond 32 bits should not be truncated. The file is sparse, so it takes no space.
+ **/
+void test_read_large_offset(){
+	const char *filename = "test_readimage_large.img";
+	off_t offset = ((off_t)5 << 30) + 7;
+	write_test_header("test_readimage_large", 2, offset);
+	if (!write_test_image(filename, 2, offset)){
+		fprintf(stderr, "Could not write sparse file with large offset, skipping\n");
+	} else {
+		HyspexHeader header;
+		TEST_CHECK(hyperspectral_try_read_header(filename, &header) == HYPERSPECTRAL_NO_ERR);
+		TEST_CHECK(header.offset == offset);
+		check_read_image(filename, &header);
+		check_reader(filename, &header);
+	}
+	unlink(filename);
+	unlink("test_readimage_large.hdr");
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * Read gzip-compressed image with header offset, which is skipped in the decompressed stream.
+ **/
+void test_read_gzip(){
+	const char *filename = "test_readimage_gz.img.gz";
+	off_t offset = 45;
+	write_test_header("test_readimage_gz", 4, offset);
+	vector<char> data = test_image_data(4);
+	gzFile gz = gzopen(filename, "wb");
+	vector<char> headerBytes(offset, 'x');
+	TEST_CHECK(gzwrite(gz, &headerBytes[0], headerBytes.size()) == (int)headerBytes.size());
+	TEST_CHECK(gzwrite(gz, &data[0], data.size()) == (int)data.size());
+	gzclose(gz);
+
+	HyspexHeader header;
+	TEST_CHECK(hyperspectral_try_read_header(filename, &header) == HYPERSPECTRAL_NO_ERR);
+	check_read_image(filename, &header);
+	check_reader(filename, &header);
+	unlink(filename);
+	unlink("test_readimage_gz.hdr");
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/**
+ * Append little endian 32-bit value.
+ **/
+void append_le32(vector<char> *bytes, unsigned int value){
+	for (int i=0; i < 4; i++){
+		bytes->push_back((value >> (8*i)) & 0xff);
+	}
+}
+
+/**
+ * Compress data as zstd, either as a single frame or in the seekable format: independent frames of frameBytes decompressed bytes
+ * followed by a skippable frame containing the seek table.
+ **/
+vector<char> zstd_compress(const vector<char> &data, size_t frameBytes, bool seekable){
+	vector<char> compressed;
+	vector<char> seekTable;
+	int numFrames = 0;
+	for (size_t start=0; start < data.size(); start += frameBytes){
+		size_t size = min(frameBytes, data.size() - start);
+		vector<char> frame(ZSTD_compressBound(size));
+		size_t frameSize = ZSTD_compress(&frame[0], frame.size(), &data[start], size, 1);
+		TEST_CHECK(!ZSTD_isError(frameSize));
+		compressed.insert(compressed.end(), frame.begin(), frame.begin() + frameSize);
+		append_le32(&seekTable, frameSize);
+		append_le32(&seekTable, size);
+		numFrames++;
+	}
+	if (seekable){
+		append_le32(&compressed, 0x184D2A5E);
+		append_le32(&compressed, seekTable.size() + 9);
+		compressed.insert(compressed.end(), seekTable.begin(), seekTable.end());
+		append_le32(&compressed, numFrames);
+		compressed.push_back(0);
+		append_le32(&compressed, 0x8F92EAB1);
+	}
+	return compressed;
+}
+
+/**
+ * Read zstd-compressed images with header offset, as a single frame and in the seekable format. Seekable images are read from the frame 
+ * containing the start line, and frames end in the middle of lines.
+ **/
+void test_read_zstd(){
+	const char *filename = "test_readimage_zst.img.zst";
+	off_t offset = 45;
+	write_test_header("test_readimage_zst", 4, offset);
+	vector<char> data(offset, 'x');
+	vector<char> imageData = test_image_data(4);
+	data.insert(data.end(), imageData.begin(), imageData.end());
+	size_t lineBytes = sizeof(float)*NUM_BANDS*NUM_SAMPLES;
+
+	for (int seekable=0; seekable < 2; seekable++){
+		vector<char> compressed = zstd_compress(data, seekable ? 300 : data.size(), seekable);
+		FILE *fp = fopen(filename, "wb");
+		TEST_CHECK(fwrite(&compressed[0], 1, compressed.size(), fp) == compressed.size());
+		fclose(fp);
+		TEST_CHECK(hyperspectral_reader_can_seek(filename) == (bool)seekable);
+
+		HyspexHeader header;
+		TEST_CHECK(hyperspectral_try_read_header(filename, &header) == HYPERSPECTRAL_NO_ERR);
+		check_read_image(filename, &header);
+		check_reader(filename, &header);
+
+		//start line in the middle of the image and of a frame
+		int startLine = NUM_LINES/2;
+		TEST_CHECK((offset + startLine*lineBytes) % 300 != 0);
+		vector<float> lines(NUM_LINES*NUM_BANDS*NUM_SAMPLES);
+		HyspexReader reader;
+		TEST_CHECK(hyperspectral_try_reader_open(&reader, filename, &header, startLine) == HYPERSPECTRAL_NO_ERR);
+		TEST_CHECK(hyperspectral_reader_read_lines(&reader, NUM_LINES, &lines[0]) == NUM_LINES - startLine);
+		TEST_CHECK(same_lines(&lines[0], startLine, NUM_LINES - startLine));
+		hyperspectral_reader_close(&reader);
+	}
+	unlink(filename);
+	unlink("test_readimage_zst.hdr");
+}
+#endif
+
+/**
+ * Read whole file. 
+ **/
+vector<char> read_file(const char *filename){
+	vector<char> contents;
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL){
+		return contents;
+	}
+	char buffer[4096];
+	size_t sizeRead;
+	while ((sizeRead = fread(buffer, 1, sizeof(buffer), fp)) > 0){
+		contents.insert(contents.end(), buffer, buffer + sizeRead);
+	}
+	fclose(fp);
+	return contents;
+}
+
+/**
+ * Images written line by line with an unknown number of lines should be read back unchanged, and the header should be updated with the 
+ * number of written lines. Written in the same bytes as hyperspectral_write_image(), and in BIP with datatype conversion. 
+ **/
+void test_writer(){
+	vector<char> floatData = test_image_data(4);
+	vector<float> wlens(NUM_BANDS, 500);
+	HyspexWriter writer;
+	hyperspectral_writer_open(&writer, "test_writer", NUM_BANDS, NUM_SAMPLES, -1, wlens);
+	size_t lineBytes = sizeof(float)*NUM_BANDS*NUM_SAMPLES;
+	for (int i=0; i < NUM_LINES; i += 5){
+		hyperspectral_writer_write_lines(&writer, min(5, NUM_LINES - i), &floatData[i*lineBytes]);
+	}
+	hyperspectral_writer_close(&writer);
+
+	HyspexHeader header;
+	TEST_CHECK(hyperspectral_try_read_header("test_writer.img", &header) == HYPERSPECTRAL_NO_ERR);
+	TEST_CHECK((header.lines == NUM_LINES) && (header.samples == NUM_SAMPLES) && (header.bands == NUM_BANDS) && (header.offset == 0));
+	vector<char> headerText = read_file("test_writer.hdr");
+	headerText.push_back('\0');
+	TEST_CHECK(strstr(&headerText[0], "default bands") != NULL);
+	check_read_image("test_writer.img", &header);
+	vector<char> writerBytes = read_file("test_writer.img");
+	TEST_CHECK(writerBytes == floatData);
+
+	hyperspectral_write_image("test_write_image", NUM_BANDS, NUM_SAMPLES, NUM_LINES, (float*)&floatData[0]);
+	TEST_CHECK(read_file("test_write_image.img") == writerBytes);
+
+	//16-bit BIP output
+	hyperspectral_writer_open(&writer, "test_writer", NUM_BANDS, NUM_SAMPLES, NUM_LINES, wlens, 2, "bip");
+	hyperspectral_writer_write_lines(&writer, NUM_LINES, &floatData[0]);
+	hyperspectral_writer_close(&writer);
+	vector<char> bipBytes = read_file("test_writer.img");
+	TEST_CHECK(bipBytes.size() == sizeof(short)*NUM_LINES*NUM_BANDS*NUM_SAMPLES);
+	bool equal = true;
+	for (int i=0; (i < NUM_LINES) && (bipBytes.size() == sizeof(short)*NUM_LINES*NUM_BANDS*NUM_SAMPLES); i++){
+		for (int j=0; j < NUM_SAMPLES; j++){
+			for (int b=0; b < NUM_BANDS; b++){
+				short value;
+				memcpy(&value, &bipBytes[sizeof(short)*(((size_t)i*NUM_SAMPLES + j)*NUM_BANDS + b)], sizeof(short));
+				equal = equal && (value == test_value(i, b, j));
+			}
+		}
+	}
+	TEST_CHECK(equal);
+
+	unlink("test_writer.img");
+	unlink("test_writer.hdr");
+	unlink("test_write_image.img");
+}
+
+int main(){
+	test_read_uncompressed();
+	test_read_large_offset();
+#ifdef HAVE_ZLIB
+	test_read_gzip();
+#endif
+#ifdef HAVE_ZSTD
+	test_read_zstd();
+#endif
+	test_writer();
+	return test_report("test_readimage");
+}
@@ -0,0 +1,147 @@
+//==============================================================================
+// Copyright 2015 Asgeir Bjorgan, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT)
+//==============================================================================
+
+#include "test_common.h"
+#include "readimage.h"
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+using namespace std;
+
+#define NUM_SAMPLES 32
+#define NUM_LINES 10
+#define NUM_BANDS 61
+
+/**
+ * Exit code telling ctest that the test was skipped.
+ **/
+#define TEST_SKIPPED 77
+
+/**
+ * Run shell command.
+ * \param command Command
+ * \param output Output, the standard output of the command
+ * \return Exit status of the command, -1 if it could not be run
+ **/
+int run_command(const string &command, string *output){
+	FILE *fp = popen(command.c_str(), "r");
+	if (fp == NULL){
+		return -1;
+	}
+	output->clear();
+	char buffer[4096];
+	size_t sizeRead;
+	while ((sizeRead = fread(buffer, 1, sizeof(buffer), fp)) > 0){
+		output->append(buffer, sizeRead);
+	}
+	int status = pclose(fp);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Start masking server on socket_path, wait until it listens.
+ * \return Process ID of the server, -1 on failure
+ **/
+pid_t start_server(const char *masking_bin, const char *socket_path){
+	unlink(socket_path);
+	pid_t pid = fork();
+	if (pid == 0){
+		execl(masking_bin, masking_bin, "-d", socket_path, "-w", "2", (char*)NULL);
+		_exit(127);
+	}
+	for (int i=0; (pid > 0) && (i < 500); i++){
+		struct stat socket_stat;
+		if ((stat(socket_path, &socket_stat) == 0) && S_ISSOCK(socket_stat.st_mode)){
+			return pid;
+		}
+		usleep(10000);
+	}
+	return -1;
+}
+
+/**
+ * Write test image with wavelengths covering the spectral library, from noisy copies of the reference spectra so that the mask
+ * is neither empty nor full.
+ * \return False if the spectral library could not be read
+ **/
+bool write_test_image(const char *basename){
+	vector<float> wlens(NUM_BANDS);
+	for (int i=0; i < NUM_BANDS; i++){
+		wlens[i] = 400 + 10*i;
+	}
+	masking_t mask_param;
+	if (masking_init(NUM_BANDS, &wlens[0], REFLECTANCE_MASKING, &mask_param) != MASKING_NO_ERR){
+		return false;
+	}
+	float *data = test_generate_image(&mask_param, NUM_SAMPLES, NUM_LINES, 1);
+	HyspexWriter writer;
+	hyperspectral_writer_open(&writer, basename, NUM_BANDS, NUM_SAMPLES, NUM_LINES, wlens);
+	hyperspectral_writer_write_lines(&writer, NUM_LINES, data);
+	hyperspectral_writer_close(&writer);
+	delete [] data;
+	masking_free(&mask_param);
+	return true;
+}
+
+/**
+ * Masks from masking-client with the image filename and with the image data passed through shared memory, over several requests
+ * on one connection, should equal the mask from masking-bin. Images that end before the number of lines in the header should give
+ * an error response.
+ * \param argv Paths to masking-bin and masking-client
+ **/
+int main(int argc, char *argv[]){
+	if (argc < 3){
+		fprintf(stderr, "Usage: %s masking-bin masking-client\n", argv[0]);
+		return 1;
+	}
+	string masking_bin = argv[1];
+	string masking_client = argv[2];
+	const char *socket_path = "test_server.sock";
+	if (!write_test_image("test_server")){
+		fprintf(stderr, "Could not read spectral library in %s, skipping\n", REFLECTANCE_MASKING_SPECTRA_DIRECTORY);
+		return TEST_SKIPPED;
+	}
+
+	string serial_mask;
+	TEST_CHECK(run_command("'" + masking_bin + "' test_server.img 2>/dev/null", &serial_mask) == 0);
+	TEST_CHECK(serial_mask.find('1') != string::npos);
+	TEST_CHECK(serial_mask.find('0') != string::npos);
+
+	pid_t server = start_server(masking_bin.c_str(), socket_path);
+	TEST_CHECK(server > 0);
+	if (server > 0){
+		string file_mask, data_mask;
+		TEST_CHECK(run_command("'" + masking_client + "' " + socket_path + " test_server.img", &file_mask) == 0);
+		TEST_CHECK(file_mask == serial_mask);
+		TEST_CHECK(run_command("'" + masking_client + "' -f -n 3 " + socket_path + " test_server.img", &data_mask) == 0);
+		TEST_CHECK(data_mask == serial_mask);
+
+		//truncated image: header claims more lines than there are data
+		HyspexHeader header;
+		hyperspectral_read_header((char*)"test_server.img", &header);
+		hyperspectral_write_header("test_server", NUM_BANDS, NUM_SAMPLES, NUM_LINES + 5, header.wlens);
+		string error_output;
+		TEST_CHECK(run_command("'" + masking_client + "' " + socket_path + " test_server.img 2>&1", &error_output) != 0);
+		TEST_CHECK(error_output.find("Masking server error: Image ended early") != string::npos);
+
+		//server keeps serving after the error
+		hyperspectral_write_header("test_server", NUM_BANDS, NUM_SAMPLES, NUM_LINES, header.wlens);
+		TEST_CHECK(run_command("'" + masking_client + "' " + socket_path + " test_server.img", &file_mask) == 0);
+		TEST_CHECK(file_mask == serial_mask);
+
+		kill(server, SIGTERM);
+		int status;
+		TEST_CHECK((waitpid(server, &status, 0) == server) && WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+	}
+	unlink(socket_path);
+	unlink("test_server.img");
+	unlink("test_server.hdr");
+	return test_report("test_server");
+}